@@ -0,0 +1,239 @@
+#include <string>
+#include <cstring>
+#include <chrono>
+
+/* Automatic tuning.
+ *
+ *   crt-filter --autotune <in-width> <in-height> <out-width> <out-height> <numscanlines>
+ *
+ * The fastest settings of Tuning depend on the machine and on the geometry.
+ * The autotuner filters synthetic frames (see SyntheticCorpus()) of the
+ * given geometry with candidate settings, one parameter at a time, keeping
+ * the fastest value of each. The result is saved into a profile file,
+ * keyed by the CPU model and the geometry. Later runs of the same geometry
+ * on the same kind of CPU load it automatically.
+ *
+ * The profile is ~/.crt-filter-profile, or $CRT_FILTER_PROFILE if set.
+ * Each line is: <cpu model> TAB <geometry> TAB <settings>.
+ */
+static std::string CpuModel()
+{
+    std::string result = "unknown";
+    if(std::FILE* fp = std::fopen("/proc/cpuinfo", "r"))
+    {
+        char line[512];
+        while(std::fgets(line, sizeof(line), fp))
+            if(std::strncmp(line, "model name", 10) == 0)
+                if(const char* p = std::strchr(line, ':'))
+                {
+                    result = p + 1 + std::strspn(p+1, " \t");
+                    result.erase(result.find_last_not_of(" \t\n") + 1);
+                    break;
+                }
+        std::fclose(fp);
+    }
+    return result;
+}
+
+static std::string ProfilePath()
+{
+    if(const char* path = std::getenv("CRT_FILTER_PROFILE")) return path;
+    const char* home = std::getenv("HOME");
+    return std::string(home ? home : ".") + "/.crt-filter-profile";
+}
+
+static std::string ProfileKey(unsigned in_width, unsigned in_height,
+                              unsigned out_width, unsigned out_height, unsigned NumScanlines)
+{
+    char geometry[64];
+    std::snprintf(geometry, sizeof(geometry), "%ux%u->%ux%u/%u", in_width, in_height, out_width, out_height, NumScanlines);
+    return CpuModel() + '\t' + geometry;
+}
+
+static std::string FormatTuning(const Tuning& t)
+{
+    char result[128];
+    std::snprintf(result, sizeof(result), "threads=%u band_rows=%u frames=%u",
+                  t.threads, t.band_rows, t.frames);
+    return result;
+}
+
+static bool ParseTuning(const char* text, Tuning& t)
+{
+    Tuning result;
+    if(std::sscanf(text, "threads=%u band_rows=%u frames=%u",
+                   &result.threads, &result.band_rows, &result.frames) != 3
+    || !result.band_rows)
+        return false;
+    t = result;
+    return true;
+}
+
+/* Lines of the profile file, except the one with the given key. */
+static std::vector<std::string> ProfileLines(const std::string& key, std::string* found)
+{
+    std::vector<std::string> result;
+    if(std::FILE* fp = std::fopen(ProfilePath().c_str(), "r"))
+    {
+        char line[1024];
+        while(std::fgets(line, sizeof(line), fp))
+        {
+            std::string s(line);
+            if(s.compare(0, key.size(), key) == 0 && s.size() > key.size() && s[key.size()] == '\t')
+                { if(found) *found = s.substr(key.size()+1); }
+            else
+                result.push_back(s);
+        }
+        std::fclose(fp);
+    }
+    return result;
+}
+
+static bool LoadTuning(const std::string& key, Tuning& t)
+{
+    std::string settings;
+    ProfileLines(key, &settings);
+    return !settings.empty() && ParseTuning(settings.c_str(), t);
+}
+
+static bool SaveTuning(const std::string& key, const Tuning& t)
+{
+    auto lines = ProfileLines(key, nullptr);
+    lines.push_back(key + '\t' + FormatTuning(t) + '\n');
+    const std::string path = ProfilePath(), temp = path + ".tmp";
+    std::FILE* fp = std::fopen(temp.c_str(), "w");
+    if(!fp) { std::perror(temp.c_str()); return false; }
+    for(auto& l: lines) std::fputs(l.c_str(), fp);
+    if(std::fclose(fp) != 0 || std::rename(temp.c_str(), path.c_str()) != 0)
+    {
+        std::perror(path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* Number of threads when Tuning::threads is 0. */
+static unsigned DefaultThreads()
+{
+#ifdef _OPENMP
+    static const unsigned result = omp_get_max_threads();
+#else
+    static const unsigned result = std::max(1u, std::thread::hardware_concurrency());
+#endif
+    return result;
+}
+
+static void ApplyTuning(const Tuning& t)
+{
+    const unsigned threads = t.threads ? t.threads : DefaultThreads();
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    TaskPool::Shared().Resize(threads);
+    CurrentTuning = t;
+}
+
+/* Loads and applies the profile for the geometry, if there is one. */
+static void LoadProfile(unsigned in_width, unsigned in_height,
+                        unsigned out_width, unsigned out_height, unsigned NumScanlines)
+{
+    DefaultThreads(); // Before anything changes it
+    Tuning t;
+    if(LoadTuning(ProfileKey(in_width, in_height, out_width, out_height, NumScanlines), t))
+        ApplyTuning(t);
+}
+
+static int RunAutotune(unsigned in_width, unsigned in_height,
+                       unsigned out_width, unsigned out_height, unsigned NumScanlines)
+{
+    using Clock = std::chrono::steady_clock;
+    const unsigned max_threads = DefaultThreads();
+    std::vector<CorpusFrame> corpus;
+    for(auto& f: SyntheticCorpus(in_width, in_height))
+        if(f.name == "text" || f.name == "ramp")
+            corpus.push_back(std::move(f));
+
+    std::printf("Tuning for %ux%u -> %ux%u, %u scanlines, on %s (%u threads)\n",
+        in_width, in_height, out_width, out_height, NumScanlines, CpuModel().c_str(), max_threads);
+
+    // Milliseconds per frame with the settings, the best of two rounds.
+    // If streams is nonzero, frames are filtered by that many threads at once,
+    // t.frames at a time, as in the server mode.
+    auto measure = [&](const Tuning& t, unsigned streams)
+    {
+        ApplyTuning(t);
+        double best = INFINITY;
+        for(unsigned round=0; round<2; ++round)
+        {
+            auto begin = Clock::now();
+            if(!streams)
+            {
+                std::vector<std::uint32_t> output(out_width*out_height);
+                for(auto& f: corpus)
+                    ConvertPicture(in_width, in_height, out_width, out_height, NumScanlines, &f.pixels[0], &output[0]);
+            }
+            else
+            {
+                FairShare share(t.frames);
+                std::vector<std::thread> threads;
+                for(unsigned s=0; s<streams; ++s)
+                    threads.emplace_back([&,s]
+                    {
+                    #ifdef _OPENMP
+                        omp_set_num_threads(1);
+                    #endif
+                        TaskPool::Shared().SetHomeNode(s % NumNodes());
+                        unsigned client = share.Join(1);
+                        std::vector<std::uint32_t> output(out_width*out_height);
+                        for(auto& f: corpus)
+                            share.Run(client, [&]
+                            {
+                                ConvertPicture(in_width, in_height, out_width, out_height, NumScanlines, &f.pixels[0], &output[0]);
+                            });
+                        share.Leave(client);
+                    });
+                for(auto& th: threads) th.join();
+            }
+            double ms = std::chrono::duration<double, std::milli>(Clock::now() - begin).count()
+                      / (corpus.size() * std::max(streams, 1u));
+            best = std::min(best, ms);
+        }
+        std::printf("  %-70s %9.1f ms/frame\n", FormatTuning(t).c_str(), best);
+        std::fflush(stdout);
+        return best;
+    };
+
+    // One parameter at a time: keep the fastest candidate.
+    Tuning best;
+    auto tune = [&](unsigned Tuning::*param, std::vector<unsigned> candidates, unsigned streams = 0)
+    {
+        double best_ms = INFINITY;
+        unsigned best_value = best.*param;
+        for(unsigned value: candidates)
+        {
+            Tuning t = best;
+            t.*param = value;
+            double ms = measure(t, streams);
+            if(ms < best_ms) { best_ms = ms; best_value = value; }
+        }
+        best.*param = best_value;
+    };
+
+    std::vector<unsigned> threads;
+    for(unsigned n=max_threads; n>=1; n/=2) threads.push_back(n);
+    measure(best, 0); // Warm up
+    tune(&Tuning::threads,   threads);
+    tune(&Tuning::band_rows, { 16, 32, 64, 128, 256 });
+    if(best.threads > 1)
+    {
+        std::vector<unsigned> frames;
+        for(unsigned n=1; n<=best.threads; n*=2) frames.push_back(n);
+        tune(&Tuning::frames, frames, 4);
+    }
+
+    const std::string key = ProfileKey(in_width, in_height, out_width, out_height, NumScanlines);
+    std::printf("Best: %s\n", FormatTuning(best).c_str());
+    if(!SaveTuning(key, best)) return 1;
+    std::printf("Saved into %s\n", ProfilePath().c_str());
+    return 0;
+}
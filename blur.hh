@@ -1,10 +1,35 @@
 #include <cmath>
+#include <vector>
+#include <algorithm>
+#include "dispatch.hh"
+
+/* box_blur_line(): One pass of a box filter of radius r along one line
+ * (a row or a column) of n elements, step elements apart, of which
+ * every element holds lanes interleaved signals.
+ * The line loops are the kernels; the OpenMP loops over the lines are
+ * in the callers, because parallel regions are not cloned (see dispatch.hh).
+ */
+template<unsigned lanes, typename elem_t>
+KERNEL void box_blur_line(const elem_t* scl, elem_t* tcl, unsigned n, unsigned step, unsigned r, float iarr)
+{
+    unsigned ti = 0, li = ti, ri = ti+r*step;
+    elem_t fv[lanes], lv[lanes]; int val[lanes];
+    for(unsigned c=0; c<lanes; ++c) { fv[c] = scl[ti+c]; lv[c] = scl[ti+step*(n-1)+c]; val[c] = (r+1)*fv[c]; }
+    for(unsigned j=0; j<r; ++j)
+        for(unsigned c=0; c<lanes; ++c) val[c] += scl[ti+j*step+c];
+    for(unsigned j=0  ; j<=r ; ++j, ri+=step, ti+=step)
+        for(unsigned c=0; c<lanes; ++c) { val[c] += scl[ri+c] - fv[c]     ;   tcl[ti+c] = std::round(val[c]*iarr); }
+    for(unsigned j=r+1; j<n-r; ++j, ri+=step, li+=step, ti+=step)
+        for(unsigned c=0; c<lanes; ++c) { val[c] += scl[ri+c] - scl[li+c];   tcl[ti+c] = std::round(val[c]*iarr); }
+    for(unsigned j=n-r; j<n  ; ++j, li+=step, ti+=step)
+        for(unsigned c=0; c<lanes; ++c) { val[c] += lv[c]     - scl[li+c];   tcl[ti+c] = std::round(val[c]*iarr); }
+}
 
 /* blur(): Really fast O(n) gaussian blur algorithm (gaussBlur_4)
  * By Ivan Kuckir with ideas from Wojciech Jarosz
  * Adapted from http://blog.ivank.net/fastest-gaussian-blur.html
  *
- * input:  The two-dimensional array of input signal. Must contain w*h elements.
+ * input:  The two-dimensional array of input signal. Must contain w*h*lanes elements.
  * output: Where the two-dimensional array of blurred signal will be written
  * temp:   Another array, for temporary use. Same size as input and output.
  * w:      Width of array
@@ -12,9 +37,10 @@
  * sigma:  Blurring kernel size. Must be smaller than w and h.
  * n_boxes: Controls the blurring quality. 1 = box filter. 3 = pretty good filter.
  *          Higher number = diminishingly better results, but linearly slower.
+ * lanes:  Number of interleaved signals (e.g. 4 for RGBx pixels), blurred together.
  * elem_t: Type of elements. Should be integer type.
  */
-template<unsigned n_boxes, typename elem_t>
+template<unsigned n_boxes, unsigned lanes = 1, typename elem_t>
 void blur(const elem_t* input, elem_t* output, elem_t* temp,
           unsigned w,unsigned h,float sigma)
 {
@@ -30,31 +56,100 @@ void blur(const elem_t* input, elem_t* output, elem_t* temp,
         // boxBlur_4:
         float iarr = 1.f / (r+r+1);
         // boxBlurH_4 (blur horizontally for each row):
-        const elem_t* scl = data; elem_t* tcl = temp;
+        #pragma omp parallel for schedule(static) if(lanes > 1)
         for(unsigned i=0; i<h; ++i)
-        {
-            auto ti = i*w, li = ti, ri = ti+r;
-            auto fv = scl[ti], lv = scl[ti+w-1]; int val = 0;
-            #pragma omp simd reduction(+:val)
-            for(unsigned j=0; j<r; j++) val += scl[ti+j];
-            val += (r+1)*fv;
-            for(unsigned j=0  ; j<=r ; j++) { val += scl[ri++] - fv       ;   tcl[ti++] = std::round(val*iarr); }
-            for(unsigned j=r+1; j<w-r; j++) { val += scl[ri++] - scl[li++];   tcl[ti++] = std::round(val*iarr); }
-            for(unsigned j=w-r; j<w  ; j++) { val += lv        - scl[li++];   tcl[ti++] = std::round(val*iarr); }
-        }
+            box_blur_line<lanes>(data + i*w*lanes, temp + i*w*lanes, w, lanes, r, iarr);
         // boxBlurT_4 (blur vertically for each column)
-        scl = temp; tcl = output;
+        #pragma omp parallel for schedule(static) if(lanes > 1)
         for(unsigned i=0; i<w; ++i)
+            box_blur_line<lanes>(temp + i*lanes, output + i*lanes, h, w*lanes, r, iarr);
+        data = output;
+    }
+}
+
+
+/* blur_support(): The distance (in rows or columns) within which
+ * the output of blur() or scaled_blur() depends on the input.
+ * Beyond this distance, neither the input nor the edge of the array
+ * has any effect on the output.
+ */
+template<unsigned n_boxes>
+unsigned blur_support(float sigma, unsigned scale = 1)
+{
+    if(scale > 1) return (blur_support<n_boxes>(sigma / scale) + 2) * scale;
+
+    // Same calculation as in blur().
+    auto wIdeal = std::sqrt((12*sigma*sigma/n_boxes)+1);
+    unsigned wl = wIdeal; if(wl%2==0) --wl;
+    unsigned wu = wl+2;
+    auto mIdeal = (12*sigma*sigma - n_boxes*wl*wl - 4*n_boxes*wl - 3*n_boxes)/(-4.*wl - 4);
+    unsigned m = std::round(mIdeal);
+    unsigned result = 0;
+    for(unsigned n=0; n<n_boxes; ++n)
+        result += ((n<m ? wl : wu) - 1)/2;
+    return result;
+}
+
+/* Row y of the box-downsampled picture (sw columns) for scaled_blur(). */
+template<unsigned lanes, typename elem_t>
+KERNEL void downsample_row(const elem_t* input, elem_t* out, unsigned w,unsigned h, unsigned sw, unsigned y, unsigned scale)
+{
+    for(unsigned x=0; x<sw; ++x)
+        for(unsigned c=0; c<lanes; ++c)
         {
-            auto ti = i, li = ti, ri = ti+r*w;
-            auto fv = scl[ti], lv = scl[ti+w*(h-1)]; int val = 0;
-            #pragma omp simd reduction(+:val)
-            for(unsigned j=0; j<r;  ++j) val += scl[ti + j*w];
-            val += (r+1)*fv;
-            for(unsigned j=0; j<=r; ++j)    { val += scl[ri] - fv     ;  tcl[ti] = std::round(val*iarr);  ri+=w; ti+=w; }
-            for(unsigned j=r+1; j<h-r; ++j) { val += scl[ri] - scl[li];  tcl[ti] = std::round(val*iarr);  li+=w; ri+=w; ti+=w; }
-            for(unsigned j=h-r; j<h; ++j)   { val += lv      - scl[li];  tcl[ti] = std::round(val*iarr);  li+=w; ti+=w; }
+            int val = 0, count = 0;
+            for(unsigned v=y*scale; v<std::min(h, (y+1)*scale); ++v)
+                for(unsigned u=x*scale; u<std::min(w, (x+1)*scale); ++u)
+                    { val += input[(v*w+u)*lanes+c]; ++count; }
+            out[x*lanes+c] = val / count;
+        }
+}
+
+/* Row y of the bilinearly upsampled picture (w columns) for scaled_blur(). */
+template<unsigned lanes, typename elem_t>
+KERNEL void upsample_row(const elem_t* small, elem_t* out, unsigned w, unsigned sw,unsigned sh, unsigned y, unsigned scale)
+{
+    float fy = std::clamp((y+0.5f) / scale - 0.5f, 0.f, sh-1.f);
+    unsigned y0 = fy, y1 = std::min(y0+1, sh-1);
+    float wy = fy - y0;
+    for(unsigned x=0; x<w; ++x)
+    {
+        float fx = std::clamp((x+0.5f) / scale - 0.5f, 0.f, sw-1.f);
+        unsigned x0 = fx, x1 = std::min(x0+1, sw-1);
+        float wx = fx - x0;
+        for(unsigned c=0; c<lanes; ++c)
+        {
+            float top = small[(y0*sw+x0)*lanes+c] * (1-wx) + small[(y0*sw+x1)*lanes+c] * wx;
+            float bot = small[(y1*sw+x0)*lanes+c] * (1-wx) + small[(y1*sw+x1)*lanes+c] * wx;
+            out[x*lanes+c] = std::round(top * (1-wy) + bot * wy);
         }
-        data = output;
     }
 }
+
+/* scaled_blur(): Same as blur(), but the blur is computed at 1/scale resolution.
+ * The input is box-downsampled, blurred with sigma/scale, and bilinearly
+ * upsampled back into output. With scale=1, this is exactly blur().
+ * Cost of the blur itself drops by scale*scale.
+ *
+ * Parameters are as in blur(), plus:
+ * scale:  Integer downsampling factor.
+ */
+template<unsigned n_boxes, unsigned lanes = 1, typename elem_t>
+void scaled_blur(const elem_t* input, elem_t* output, elem_t* temp,
+                 unsigned w,unsigned h,float sigma, unsigned scale)
+{
+    if(scale <= 1) { blur<n_boxes,lanes>(input, output, temp, w, h, sigma); return; }
+
+    unsigned sw = (w + scale-1) / scale, sh = (h + scale-1) / scale;
+    std::vector<elem_t> small(sw*sh*lanes), smallout(sw*sh*lanes), smalltemp(sw*sh*lanes);
+
+    #pragma omp parallel for schedule(static)
+    for(unsigned y=0; y<sh; ++y)
+        downsample_row<lanes>(input, &small[y*sw*lanes], w, h, sw, y, scale);
+
+    blur<n_boxes,lanes>(&small[0], &smallout[0], &smalltemp[0], sw, sh, sigma / scale);
+
+    #pragma omp parallel for schedule(static)
+    for(unsigned y=0; y<h; ++y)
+        upsample_row<lanes>(&smallout[0], &output[y*w*lanes], w, sw, sh, y, scale);
+}
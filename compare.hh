@@ -0,0 +1,370 @@
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <optional>
+
+/* Reference-accuracy harness.
+ *
+ *   crt-filter --compare [--corpus <file>]... [--path <name>]... <in-width> <in-height> <out-width> <out-height> <numscanlines>
+ *
+ * Renders a corpus of frames using the reference path of ConvertPicture()
+ * (FilterOptions::Reference()), and using each alternate path listed below.
+ * For every frame and path, reports the largest absolute difference
+ * of any color channel, the difference that 99.9% of the channels are within,
+ * the PSNR, and the time taken by both paths.
+ * The sparse, scroll and tiles paths first filter a previous frame, which is
+ * the frame scrolled by a usable shift, and then filter the frame reusing
+ * its output (see ConstantRegions, ScrollReuse and TileCache).
+ * Only the second frame is timed.
+ * A path fails if its error exceeds its thresholds.
+ * With --path, only the named paths are tested.
+ * Exit status is nonzero if any path failed.
+ *
+ * The corpus consists of synthetic frames, and optionally of raw BGRA
+ * files of the input geometry (such as the pictures in img/ converted
+ * with ffmpeg). A file may contain several frames.
+ */
+
+enum class Reuse { None, Sparse, Scroll, Tiles };
+
+struct FilterVariant
+{
+    const char*   name;
+    FilterOptions options;
+    unsigned      max_abs_error; // Largest allowed difference in any channel, 0..255
+    unsigned      max_p999;      // Largest allowed difference of 99.9% of the channels
+    double        min_psnr;      // Smallest allowed PSNR, in dB
+    Reuse         reuse = Reuse::None;
+};
+
+static FilterOptions MakeOptions(unsigned radius, unsigned bloomscale, unsigned vertstep)
+{
+    FilterOptions result = FilterOptions::Reference();
+    result.LanczosRadius = radius;
+    result.BloomScale    = bloomscale;
+    result.VertStep      = vertstep;
+    return result;
+}
+
+static FilterOptions WithFusedInput()
+{
+    FilterOptions result = FilterOptions::Reference();
+    result.FusedInput = true;
+    return result;
+}
+static FilterOptions WithFusedOutput()
+{
+    FilterOptions result = FilterOptions::Reference();
+    result.FusedOutput = true;
+    return result;
+}
+
+static FilterOptions Folded()
+{
+    FilterOptions result;
+    result.FoldVertical = true;
+    return result;
+}
+
+static FilterOptions Interleaved(bool folded)
+{
+    FilterOptions result;
+    result.Interleaved  = true;
+    result.FoldVertical = folded;
+    return result;
+}
+
+/* The thresholds are the largest errors measured on the synthetic corpus
+ * (640x400 to 800x600, 1280x960, 1920x1440 and 2880x2160, 320x200 to 1280x960;
+ * with -march=native and with the dispatched kernels), plus a small margin.
+ * They are listed as largest difference / 99.9% figure / PSNR.
+ * The paths that are claimed to be exact must be exact.
+ */
+static const FilterVariant FilterVariants[] =
+{
+    // Rendering the reference twice must produce identical results.
+    { "reference",    FilterOptions::Reference(),   0,   0, INFINITY },
+    // The default, fast paths. These are exact.
+    { "default",      FilterOptions{},              0,   0, INFINITY },
+    { "fused-input",  WithFusedInput(),             0,   0, INFINITY },
+    { "fused-output", WithFusedOutput(),            0,   0, INFINITY },
+    { "sparse",       FilterOptions{},              0,   0, INFINITY, Reuse::Sparse },
+    // Paths that differ by rounding, amplified by the desaturation.
+    // Measured: folded 6 / 0 / 91.3 dB, interleaved 4 / 0 / 99.9 dB.
+    { "folded",       Folded(),                     7,   1, 90.5 },
+    { "interleaved",  Interleaved(false),           5,   1, 99.0 },
+    { "rgbx+folded",  Interleaved(true),            7,   1, 90.5 },
+    // Output moved from another position, whose weights were calculated from other coordinates.
+    // Measured: scroll 13 / 0 / 80.2 dB, tiles 4 / 1 / 71.1 dB.
+    { "scroll",       FilterOptions{},             15,   1, 79.5, Reuse::Scroll },
+    { "tiles",        FilterOptions{},              5,   2, 70.5, Reuse::Tiles },
+    // Reduced quality levels used by the real-time mode.
+    // Single pixels differ by up to 255, so only the 99.9% figure
+    // and the PSNR are bounded (and for vertstep2, only the PSNR).
+    // Measured: bloom/2 135 / 24.9 dB, bloom/4 137 / 24.3 dB,
+    // lanczos1 178 / 19.7 dB, vertstep2 255 / 14.9 dB.
+    { "bloom/2",      MakeOptions(2,2,1),         255, 142, 24.5 },
+    { "bloom/4",      MakeOptions(2,4,1),         255, 144, 24.0 },
+    { "lanczos1",     MakeOptions(1,1,1),         255, 187, 19.3 },
+    { "vertstep2",    MakeOptions(2,1,2),         255, 255, 14.5 },
+};
+
+struct CorpusFrame
+{
+    std::string                name;
+    std::vector<std::uint32_t> pixels;
+};
+
+/* The screenshot img/mpv-shot0001.jpg (GW-BASIC in 80x25 text mode),
+ * rebuilt from the text and the colors that it shows, and from the 8x8 CGA
+ * font, every row of which is doubled. With its colors quantized to the
+ * 16-color palette, the screenshot is reproduced exactly.
+ * The attributes are '7' (light gray on black), '4' (red on black)
+ * and 'R' (black on light gray), one per cell, the last one repeating.
+ */
+static const char* const BasicScreen[25][2] =
+{
+    { "60300 Bytes free", "7" },
+    { "Ok", "7" },
+    { "Hello?", "7" },
+    { "Syntax error", "7" },
+    { "Ok", "7" },
+    { "What's going on?", "7" },
+    { "Syntax error", "7" },
+    { "Ok", "7" },
+    { "", "7" },
+    { "print \"Hello, world!\"", "7" },
+    { "Hello, world!", "7" },
+    { "Ok", "7" },
+    { "color 4", "7" },
+    { "Ok", "4" },
+    { "print \"Hello\"", "4" },
+    { "Hello", "4" },
+    { "Ok", "4" },
+    { "color", "4" },
+    { "Illegal function call", "4" },
+    { "Ok", "4" },
+    { "color 7", "4" },
+    { "Ok", "7" },
+    { "10 PRINT \"Hello, world\"", "7" },
+    { "_", "7" },
+    { "1LIST   2RUN\33   3LOAD\"  4SAVE\"  5CONT\33  6,\"LPT1 7TRON\33  8TROFF\33 9KEY    0SCREEN ", "7RRRRR777RRRR7777RRRRR777RRRRR777RRRRR777RRRRRR77RRRRR777RRRRRR77RRRR7777RRRRRR7" },
+};
+static const struct { char c; std::uint8_t rows[8]; } BasicFont[] =
+{
+    {'\33',{0x00,0x30,0x60,0xFE,0x60,0x30,0x00,0x00}}, {' ',{0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}}, {'!',{0x30,0x78,0x78,0x30,0x30,0x00,0x30,0x00}},
+    {'"',{0x6C,0x6C,0x6C,0x00,0x00,0x00,0x00,0x00}}, {'\'',{0x60,0x60,0xC0,0x00,0x00,0x00,0x00,0x00}}, {',',{0x00,0x00,0x00,0x00,0x00,0x30,0x30,0x60}},
+    {'0',{0x7C,0xC6,0xCE,0xDE,0xF6,0xE6,0x7C,0x00}}, {'1',{0x30,0x70,0x30,0x30,0x30,0x30,0xFC,0x00}}, {'2',{0x78,0xCC,0x0C,0x38,0x60,0xCC,0xFC,0x00}},
+    {'3',{0x78,0xCC,0x0C,0x38,0x0C,0xCC,0x78,0x00}}, {'4',{0x1C,0x3C,0x6C,0xCC,0xFE,0x0C,0x1E,0x00}}, {'5',{0xFC,0xC0,0xF8,0x0C,0x0C,0xCC,0x78,0x00}},
+    {'6',{0x38,0x60,0xC0,0xF8,0xCC,0xCC,0x78,0x00}}, {'7',{0xFC,0xCC,0x0C,0x18,0x30,0x30,0x30,0x00}}, {'8',{0x78,0xCC,0xCC,0x78,0xCC,0xCC,0x78,0x00}},
+    {'9',{0x78,0xCC,0xCC,0x7C,0x0C,0x18,0x70,0x00}}, {'?',{0x78,0xCC,0x0C,0x18,0x30,0x00,0x30,0x00}}, {'A',{0x30,0x78,0xCC,0xCC,0xFC,0xCC,0xCC,0x00}},
+    {'B',{0xFC,0x66,0x66,0x7C,0x66,0x66,0xFC,0x00}}, {'C',{0x3C,0x66,0xC0,0xC0,0xC0,0x66,0x3C,0x00}}, {'D',{0xF8,0x6C,0x66,0x66,0x66,0x6C,0xF8,0x00}},
+    {'E',{0xFE,0x62,0x68,0x78,0x68,0x62,0xFE,0x00}}, {'F',{0xFE,0x62,0x68,0x78,0x68,0x60,0xF0,0x00}}, {'H',{0xCC,0xCC,0xCC,0xFC,0xCC,0xCC,0xCC,0x00}},
+    {'I',{0x78,0x30,0x30,0x30,0x30,0x30,0x78,0x00}}, {'K',{0xE6,0x66,0x6C,0x78,0x6C,0x66,0xE6,0x00}}, {'L',{0xF0,0x60,0x60,0x60,0x62,0x66,0xFE,0x00}},
+    {'N',{0xC6,0xE6,0xF6,0xDE,0xCE,0xC6,0xC6,0x00}}, {'O',{0x38,0x6C,0xC6,0xC6,0xC6,0x6C,0x38,0x00}}, {'P',{0xFC,0x66,0x66,0x7C,0x60,0x60,0xF0,0x00}},
+    {'R',{0xFC,0x66,0x66,0x7C,0x6C,0x66,0xE6,0x00}}, {'S',{0x78,0xCC,0xE0,0x70,0x1C,0xCC,0x78,0x00}}, {'T',{0xFC,0xB4,0x30,0x30,0x30,0x30,0x78,0x00}},
+    {'U',{0xCC,0xCC,0xCC,0xCC,0xCC,0xCC,0xFC,0x00}}, {'V',{0xCC,0xCC,0xCC,0xCC,0xCC,0x78,0x30,0x00}}, {'W',{0xC6,0xC6,0xC6,0xD6,0xFE,0xEE,0xC6,0x00}},
+    {'Y',{0xCC,0xCC,0xCC,0x78,0x30,0x30,0x78,0x00}}, {'_',{0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xFF}}, {'a',{0x00,0x00,0x78,0x0C,0x7C,0xCC,0x76,0x00}},
+    {'c',{0x00,0x00,0x78,0xCC,0xC0,0xCC,0x78,0x00}}, {'d',{0x1C,0x0C,0x0C,0x7C,0xCC,0xCC,0x76,0x00}}, {'e',{0x00,0x00,0x78,0xCC,0xFC,0xC0,0x78,0x00}},
+    {'f',{0x38,0x6C,0x60,0xF0,0x60,0x60,0xF0,0x00}}, {'g',{0x00,0x00,0x76,0xCC,0xCC,0x7C,0x0C,0xF8}}, {'h',{0xE0,0x60,0x6C,0x76,0x66,0x66,0xE6,0x00}},
+    {'i',{0x30,0x00,0x70,0x30,0x30,0x30,0x78,0x00}}, {'k',{0xE0,0x60,0x66,0x6C,0x78,0x6C,0xE6,0x00}}, {'l',{0x70,0x30,0x30,0x30,0x30,0x30,0x78,0x00}},
+    {'n',{0x00,0x00,0xF8,0xCC,0xCC,0xCC,0xCC,0x00}}, {'o',{0x00,0x00,0x78,0xCC,0xCC,0xCC,0x78,0x00}}, {'p',{0x00,0x00,0xDC,0x66,0x66,0x7C,0x60,0xF0}},
+    {'r',{0x00,0x00,0xDC,0x76,0x66,0x60,0xF0,0x00}}, {'s',{0x00,0x00,0x7C,0xC0,0x78,0x0C,0xF8,0x00}}, {'t',{0x10,0x30,0x7C,0x30,0x30,0x34,0x18,0x00}},
+    {'u',{0x00,0x00,0xCC,0xCC,0xCC,0xCC,0x76,0x00}}, {'w',{0x00,0x00,0xC6,0xD6,0xFE,0xFE,0x6C,0x00}}, {'x',{0x00,0x00,0xC6,0x6C,0x38,0x6C,0xC6,0x00}},
+    {'y',{0x00,0x00,0xCC,0xCC,0xCC,0x7C,0x0C,0xF8}},
+};
+
+/* Synthetic frames, exercising different parts of the filter. */
+static std::vector<CorpusFrame> SyntheticCorpus(unsigned w, unsigned h)
+{
+    std::uint32_t seed = 1;
+    auto rnd = [&seed] { seed = seed * 1103515245u + 12345u; return seed >> 8; };
+
+    std::vector<CorpusFrame> result;
+    auto add = [&](const char* name, auto&& func)
+    {
+        CorpusFrame f{ name, std::vector<std::uint32_t>(w*h) };
+        for(unsigned y=0; y<h; ++y)
+            for(unsigned x=0; x<w; ++x)
+                f.pixels[y*w+x] = func(x, y);
+        result.push_back(std::move(f));
+    };
+    static const std::uint32_t palette[16] =
+        { 0x000000,0x0000AA,0x00AA00,0x00AAAA,0xAA0000,0xAA00AA,0xAA5500,0xAAAAAA,
+          0x555555,0x5555FF,0x55FF55,0x55FFFF,0xFF5555,0xFF55FF,0xFFFF55,0xFFFFFF };
+
+    add("black", [](unsigned,unsigned) { return 0u; });
+    add("white", [](unsigned,unsigned) { return 0xFFFFFFu; });
+    add("noise", [&](unsigned,unsigned) { return rnd() & 0xFFFFFFu; });
+    add("sparks", [&](unsigned,unsigned) { return (rnd() % 997 == 0) ? 0xFFFFFFu : 0u; });
+    add("ramp", [&](unsigned x,unsigned y)
+    {
+        // Hue along X, brightness along Y
+        float hue = x * 6.f / w, v = (y + 0.5f) / h;
+        auto chan = [&](float offset)
+        {
+            float d = std::fabs(std::fmod(hue + offset, 6.f) - 3.f) - 1.f;
+            return unsigned(std::clamp(d, 0.f, 1.f) * v * 255.f + 0.5f);
+        };
+        return chan(0.f)*65536u + chan(4.f)*256u + chan(2.f);
+    });
+    // Real text mode content, at 640x400 scaled to the input size
+    const std::uint8_t* glyphs[256] = {};
+    for(const auto& g: BasicFont) glyphs[(unsigned char)g.c] = g.rows;
+    add("basic", [&](unsigned x,unsigned y)
+    {
+        unsigned sx = x * 640 / w, sy = y * 400 / h, cx = sx/8, cy = sy/16;
+        const char* text = BasicScreen[cy][0], *attr = BasicScreen[cy][1];
+        const std::size_t tlen = std::strlen(text), alen = std::strlen(attr);
+        const std::uint8_t* glyph = glyphs[(unsigned char)(cx < tlen ? text[cx] : ' ')];
+        bool lit = (glyph[(sy%16) / 2] >> (7 - sx%8)) & 1;
+        switch(attr[std::min<std::size_t>(cx, alen-1)])
+        {
+            case '4': return lit ? palette[4] : palette[0];
+            case 'R': return lit ? palette[0] : palette[7];
+            default:  return lit ? palette[7] : palette[0];
+        }
+    });
+    // Text mode: 8x16 cells of random glyph-like pixels in the 16-color palette
+    std::vector<std::uint32_t> cells(((w+7)/8) * ((h+15)/16) * 2);
+    for(auto& c: cells) c = rnd();
+    add("text", [&](unsigned x,unsigned y)
+    {
+        const std::uint32_t* cell = &cells[((y/16) * ((w+7)/8) + x/8) * 2];
+        unsigned cx = x%8, cy = y%16;
+        std::uint32_t bg = palette[(cell[0] >> 4) & 1], fg = palette[(cell[0] >> 8) & 15];
+        bool glyph = (cell[0] & 3) == 0 && cx < 7 && cy >= 2 && cy <= 13;
+        return (glyph && ((cell[1] >> ((cy*7 + cx) % 24)) & 1)) ? fg : bg;
+    });
+    return result;
+}
+
+static bool LoadCorpusFile(const char* filename, unsigned w, unsigned h, std::vector<CorpusFrame>& corpus)
+{
+    std::FILE* fp = std::fopen(filename, "rb");
+    if(!fp) { std::perror(filename); return false; }
+    for(unsigned frame=0; ; ++frame)
+    {
+        CorpusFrame f{ std::string(filename) + "#" + std::to_string(frame), std::vector<std::uint32_t>(w*h) };
+        if(std::fread(&f.pixels[0], 4, w*h, fp) != w*h) break;
+        corpus.push_back(std::move(f));
+    }
+    std::fclose(fp);
+    return true;
+}
+
+/* The frame scrolled up by s rows, with the rows scrolled in from the bottom. */
+static FramePtr ScrolledFrame(const std::vector<std::uint32_t>& pixels, unsigned w, unsigned h, unsigned s)
+{
+    auto result = NewFrame(std::size_t(w) * h);
+    for(unsigned y=0; y<h; ++y)
+        std::memcpy(result.get() + std::size_t(y)*w, &pixels[std::size_t((y+s) % h)*w], w*sizeof(std::uint32_t));
+    return result;
+}
+
+static int RunCompare(unsigned in_width, unsigned in_height,
+                      unsigned out_width, unsigned out_height,
+                      unsigned NumScanlines, const std::vector<const char*>& corpus_files,
+                      const std::vector<const char*>& paths)
+{
+    std::vector<CorpusFrame> corpus = SyntheticCorpus(in_width, in_height);
+    for(auto f: corpus_files)
+        if(!LoadCorpusFile(f, in_width, in_height, corpus))
+            return 1;
+
+    using Clock = std::chrono::steady_clock;
+    // The smallest shift that the scroll reuse can use, if any
+    unsigned scroll_rows = 1;
+    while(scroll_rows < in_height && !OutputRowShift(in_height, out_height, NumScanlines, scroll_rows, FilterOptions{}))
+        ++scroll_rows;
+
+    auto render = [&](const std::vector<std::uint32_t>& input, std::vector<std::uint32_t>& output,
+                      const FilterOptions& options, Reuse reuse)
+    {
+        std::optional<ConstantRegions> sparse;
+        std::optional<ScrollReuse> scroll;
+        std::optional<TileCache>   tiles;
+        auto frame = NewFrame(input.size());
+        std::copy(input.begin(), input.end(), frame.get());
+        if(reuse == Reuse::Sparse)
+        {
+            sparse.emplace(in_width, in_height, out_width, out_height, NumScanlines, options);
+            FramePtr previous = ScrolledFrame(input, in_width, in_height, scroll_rows);
+            sparse->RenderRect(previous.get(), &output[0], 0, out_width, 0, out_height);
+        }
+        if(reuse == Reuse::Scroll)
+        {
+            scroll.emplace(in_width, in_height, out_width, out_height, NumScanlines, options, true);
+            FramePtr previous = ScrolledFrame(input, in_width, in_height, scroll_rows);
+            scroll->Remember(previous, scroll->Render(previous));
+        }
+        if(reuse == Reuse::Tiles)
+        {
+            tiles.emplace(in_width, in_height, out_width, out_height, NumScanlines, options, 8, 16);
+            FramePtr previous = ScrolledFrame(input, in_width, in_height, tiles->Enabled() ? tiles->TileHeight() : 0);
+            tiles->RenderRows(previous.get(), &output[0], 0, out_height);
+        }
+
+        auto begin = Clock::now();
+        switch(reuse)
+        {
+            case Reuse::None:
+                ConvertPicture(in_width, in_height, out_width, out_height, NumScanlines, &input[0], &output[0], options);
+                break;
+            case Reuse::Sparse:
+                sparse->RenderRect(frame.get(), &output[0], 0, out_width, 0, out_height);
+                break;
+            case Reuse::Scroll:
+            {
+                FramePtr result = scroll->Render(frame);
+                std::copy(result.get(), result.get() + output.size(), output.begin());
+                break;
+            }
+            case Reuse::Tiles:
+                tiles->RenderRows(frame.get(), &output[0], 0, out_height);
+                break;
+        }
+        return std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+    };
+
+    std::printf("Comparing against reference: %ux%u -> %ux%u, %u scanlines, kernels: %s\n",
+        in_width, in_height, out_width, out_height, NumScanlines, KernelTarget());
+    std::printf("%-12s %-24s %8s %8s %9s %9s %9s %8s %s\n",
+        "path", "frame", "maxerr", "p99.9", "psnr", "ref ms", "path ms", "speedup", "");
+
+    std::vector<std::uint32_t> reference(out_width*out_height), output(out_width*out_height);
+    bool failed = false;
+    for(const auto& frame: corpus)
+    {
+        double ref_ms = render(frame.pixels, reference, FilterOptions::Reference(), Reuse::None);
+        for(const auto& variant: FilterVariants)
+        {
+            if(!paths.empty() && std::none_of(paths.begin(), paths.end(),
+                                              [&](const char* p) { return std::strcmp(p, variant.name) == 0; }))
+                continue;
+            double ms = render(frame.pixels, output, variant.options, variant.reuse);
+
+            std::size_t histogram[256] = {};
+            double      sqerr = 0;
+            for(unsigned n=0; n<out_width*out_height; ++n)
+                for(unsigned shift=0; shift<24; shift+=8)
+                {
+                    int d = int((reference[n] >> shift) & 0xFF) - int((output[n] >> shift) & 0xFF);
+                    ++histogram[std::abs(d)];
+                    sqerr += d*d;
+                }
+            const std::size_t channels = std::size_t(out_width)*out_height*3;
+            unsigned maxerr = 255, p999 = 0;
+            while(maxerr > 0 && !histogram[maxerr]) --maxerr;
+            for(std::size_t above = channels - histogram[0]; above > channels / 1000; above -= histogram[++p999]) { }
+            double mse  = sqerr / channels;
+            double psnr = mse > 0 ? 10 * std::log10(255.0*255.0 / mse) : INFINITY;
+
+            bool ok = maxerr <= variant.max_abs_error && p999 <= variant.max_p999 && psnr >= variant.min_psnr;
+            failed = failed || !ok;
+            std::printf("%-12s %-24s %8u %8u %9.2f %9.1f %9.1f %7.2fx %s\n",
+                variant.name, frame.name.c_str(), maxerr, p999, psnr, ref_ms, ms, ref_ms / ms, ok ? "ok" : "FAIL");
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -1,11 +1,23 @@
 #include <cmath>
+#include <array>
 #include <cstdint>
 #include <cstdlib>
 #include <cstdio>
 #include <vector>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <new>
+#include <numeric>
 #include <cerrno>
+#include <string_view>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include "blur.hh"
+#include "dispatch.hh"
+#include "taskgraph.hh"
 
 #define likely(x)       __builtin_expect(!!(x), 1)
 #define unlikely(x)     __builtin_expect(!!(x), 0)
@@ -41,8 +53,29 @@ static inline float GetMask(unsigned x, unsigned y)
     return (vmod < CellHeight0) & (hmod >= Start) & (hmod < End);
 }
 
+/* Because the cells of successive columns are staggered, the columns
+ * fall into NumMaskPhases phases, within which every row of the mask is alike.
+ * GetMask(x,y) is the sum over each phase p of GetPhaseMask(x,p) * MaskLit(y,p).
+ */
+constexpr unsigned NumMaskPhases = (CellHeight0 + CellHeight1) / std::gcd(CellStagger, CellHeight0 + CellHeight1);
+
+template<unsigned Start,unsigned End>
+static inline float GetPhaseMask(unsigned x, unsigned phase)
+{
+    constexpr unsigned cellwidth = CellWidth0 + CellBlank0 + CellWidth1 + CellBlank1 + CellWidth2 + CellBlank2;
+    unsigned hpix = x / cellwidth, hmod = x % cellwidth;
+    return (hpix % NumMaskPhases == phase) & (hmod >= Start) & (hmod < End);
+}
+static inline bool MaskLit(unsigned y, unsigned phase)
+{
+    constexpr unsigned cellheight = CellHeight0 + CellHeight1;
+    return (y + CellStagger * phase) % cellheight < CellHeight0;
+}
+
+constexpr float Gamma = 2.0;
+
 template<unsigned Shift>
-static void ConvertPlane(unsigned num, const std::uint32_t* pixels, float* output)
+KERNEL static void ConvertPlane(unsigned num, const std::uint32_t* pixels, float* output)
 {
     #pragma omp simd
     for(unsigned n=0; n<num; ++n)
@@ -56,6 +89,64 @@ static void ConvertPlane(unsigned num, const std::uint32_t* pixels, float* outpu
 
 
 
+/* Table for un-gammacorrecting 0..255 values into linear 0..1 values.
+ * Produces the same values as ConvertPlane() followed by Linearize().
+ */
+static const float* LinearTable()
+{
+    static const auto table = []
+    {
+        std::array<float, 256> result;
+        for(unsigned n=0; n<256; ++n)
+            result[n] = std::pow(float(n) / 255.f, 1.0 / Gamma);
+        return result;
+    }();
+    return &table[0];
+}
+
+/* Deinterleaves and linearizes one row of BGRA pixels into three planes. */
+KERNEL static void ConvertRow(unsigned num, const std::uint32_t* pixels,
+                              float* r, float* g, float* b, const float* table)
+{
+    #pragma omp simd
+    for(unsigned x=0; x<num; ++x)
+    {
+        unsigned p = pixels[x];
+        r[x] = table[(p >> 16) & 0xFF];
+        g[x] = table[(p >>  8) & 0xFF];
+        b[x] = table[(p >>  0) & 0xFF];
+    }
+}
+
+/* Same as ConvertRow(), but produces a weighted sum of nmax successive rows. */
+KERNEL static void ConvertRows(unsigned num, unsigned stride, const std::uint32_t* pixels,
+                               unsigned nmax, const float contrib[], float density_rev,
+                               float* r, float* g, float* b, const float* table)
+{
+    #pragma omp simd
+    for(unsigned x=0; x<num; ++x)
+        r[x] = g[x] = b[x] = 0.f;
+    for(unsigned n=0; n<nmax; ++n, pixels += stride)
+    {
+        const float c = contrib[n];
+        #pragma omp simd
+        for(unsigned x=0; x<num; ++x)
+        {
+            unsigned p = pixels[x];
+            r[x] += c * table[(p >> 16) & 0xFF];
+            g[x] += c * table[(p >>  8) & 0xFF];
+            b[x] += c * table[(p >>  0) & 0xFF];
+        }
+    }
+    #pragma omp simd
+    for(unsigned x=0; x<num; ++x)
+    {
+        r[x] *= density_rev;
+        g[x] *= density_rev;
+        b[x] *= density_rev;
+    }
+}
+
 template<int Radius, bool check>
 static inline float Lanczos_pi(float x_pi)
 {
@@ -122,7 +213,7 @@ public:
         tgt[tgtpos] = res;
     }
 
-    void StripeLoop(int tx, int sx, int nmax, const float contrib[], float density) const
+    KERNEL void StripeLoop(int tx, int sx, int nmax, const float contrib[], float density) const
     {
         int srcpos = sx * xinc_src; // source x pos at y = 0
         int tgtpos = tx * xinc_tgt; // target x pos at y = 0
@@ -270,14 +361,18 @@ inline LanczosCoreCalcRes LanczosCoreCalc
     float density  = 0.0;
 
     { int n=0;
+      // Taps outside the kernel contribute nothing. They must still be
+      // written, because the caller sums over all nmax taps.
       for(; n < nmax && unlikely(s_pi < s_min); ++n, s_pi += scale_pi)
-        {}
+        contrib[n] = 0;
       for(; n < nmax && likely(s_pi < s_max); ++n, s_pi += scale_pi)
       {
         float l = Lanczos_pi<FilterRadius,false> (s_pi);
         contrib[n] = l;
         density += l;
       }
+      for(; n < nmax; ++n)
+        contrib[n] = 0;
     }
 
     LanczosCoreCalcRes res;
@@ -294,10 +389,11 @@ inline LanczosCoreCalcRes LanczosCoreCalc
  * For stereo samples, use Triplet<type, 2>
  * For mono samples, just use type
  */
-template<typename Handler>
-static void LanczosScale(int in_size, int out_size, Handler& target)
+template<int FilterRadius, typename Handler>
+static void LanczosScale(int in_size, int out_size, Handler& target, int out_begin = 0, int out_end = -1)
 {
-    const int FilterRadius = 2;
+    if(out_end < 0) out_end = out_size;
+
     const float blur         = 1.0f;
 
     const float factor       = out_size / (float)in_size;
@@ -305,14 +401,14 @@ static void LanczosScale(int in_size, int out_size, Handler& target)
     const float support      = FilterRadius / scale;
 
     const std::size_t contrib_size = std::min(in_size, 5+int(2*support));
-    float contrib[contrib_size];
 
     /*fprintf(stderr, "Scaling (%d->%d), contrib=%d\n",
         in_size, out_size, (int)contrib_size);*/
 
     #pragma omp parallel for schedule(static)
-    for(int outpos=0; outpos<out_size; ++outpos)
+    for(int outpos=out_begin; outpos<out_end; ++outpos)
     {
+        float contrib[contrib_size]; // Per thread
 
         float center = (outpos+0.5f) / factor;
         LanczosCoreCalcRes res = LanczosCoreCalc<FilterRadius>(in_size, center, support, scale, contrib);
@@ -321,15 +417,135 @@ static void LanczosScale(int in_size, int out_size, Handler& target)
 }
 
 
-static void VLanczos(unsigned in_width,unsigned in_height, unsigned out_height, const float* in, float* out)
+/* Source positions [begin,end) that LanczosScale() reads
+ * for producing target positions [out_begin,out_end).
+ * Sets clipped if the kernel was cut by the edge of the source.
+ */
+struct LanczosRange { int begin, end; bool clipped; };
+
+template<int FilterRadius>
+static LanczosRange LanczosSupport(int in_size, int out_size, int out_begin, int out_end)
+{
+    const float blur         = 1.0f;
+    const float factor       = out_size / (float)in_size;
+    const float scale        = std::min(factor, (float)1.0) / blur;
+    const float support      = FilterRadius / scale;
+
+    // Same calculation as in LanczosCoreCalc().
+    float first = (out_begin+0.5f) / factor - support + (float)0.5;
+    float last  = (out_end-0.5f)   / factor + support + (float)0.5;
+    LanczosRange res;
+    res.begin   = std::max((int)first, 0);
+    res.end     = std::min((int)last, in_size);
+    res.clipped = first < 0 || last > in_size;
+    return res;
+}
+static LanczosRange LanczosSupport(unsigned radius, int in_size, int out_size, int out_begin, int out_end)
+{
+    if(radius == 1) return LanczosSupport<1>(in_size, out_size, out_begin, out_end);
+    else            return LanczosSupport<2>(in_size, out_size, out_begin, out_end);
+}
+
+/* Lanczos handler adapter, for when the source and target arrays
+ * only contain a band of the positions, starting at the given offsets.
+ */
+template<typename Handler>
+class BandHandler
+{
+    const Handler& handler;
+    int src_offset, tgt_offset;
+public:
+    BandHandler(const Handler& h, int src, int tgt) : handler(h), src_offset(src), tgt_offset(tgt) { }
+
+    void StripeLoop(int tx, int sx, int nmax, const float contrib[], float density) const
+    {
+        handler.StripeLoop(tx - tgt_offset, sx - src_offset, nmax, contrib, density);
+    }
+};
+
+static void VLanczos(unsigned in_width,unsigned in_height, unsigned out_height, const float* in, float* out, unsigned radius = 2)
 {
     VertScaler<const float*, float*> handler_y(in_width, in, out);
-    LanczosScale(in_height, out_height, handler_y);
+    if(radius == 1) LanczosScale<1>(in_height, out_height, handler_y);
+    else            LanczosScale<2>(in_height, out_height, handler_y);
 }
-static void HLanczos(unsigned in_width,unsigned in_height, unsigned out_width, const float* in, float* out)
+/* Lanczos handler for rows of interleaved RGBx pixels.
+ * The four lanes of each pixel are scaled with the same contribution,
+ * so one multiply covers all three channels.
+ */
+class InterleavedHorizScaler
+{
+    const float* in;
+    float*       out;
+public:
+    InterleavedHorizScaler(const float* i, float* o) : in(i), out(o) { }
+
+    KERNEL void StripeLoop(int tx, int sx, int nmax, const float contrib[], float density) const
+    {
+        const float density_rev = (density == 0.0f || density == 1.0f) ? 1.0f : (1.0f / density);
+        float res[4] = { 0.f, 0.f, 0.f, 0.f };
+        for(int n=0; n<nmax; ++n)
+        {
+            #pragma omp simd
+            for(unsigned c=0; c<4; ++c)
+                res[c] += contrib[n] * in[(sx+n)*4 + c];
+        }
+        #pragma omp simd
+        for(unsigned c=0; c<4; ++c)
+            out[tx*4 + c] = res[c] * density_rev;
+    }
+};
+/* Lanczos handler for the fused input front end.
+ * Each stripe is one scanline, produced directly from the BGRA input rows.
+ * The plane holds columns [left,right) of scanlines [top,top+rows).
+ */
+class InputScaler
+{
+    unsigned width, top, rows, left, right;
+    const std::uint32_t* pixels;
+    float* plane;
+    const float* table;
+public:
+    InputScaler(unsigned w, const std::uint32_t* in, float* out, unsigned t, unsigned n, unsigned l, unsigned r)
+        : width(w), top(t), rows(n), left(l), right(r), pixels(in), plane(out), table(LinearTable()) { }
+
+    void StripeLoop(int tx, int sx, int nmax, const float contrib[], float density) const
+    {
+        const float density_rev = (density == 0.0f || density == 1.0f) ? 1.0f : (1.0f / density);
+        const std::size_t stride = std::size_t(rows) * (right-left);
+        float* out = plane + std::size_t(tx-top) * (right-left);
+        ConvertRows(right-left, width, pixels + std::size_t(sx) * width + left, nmax, contrib, density_rev,
+                    out + stride*0, out + stride*1, out + stride*2, table);
+    }
+};
+
+/* Fused input front end: Deinterleaves the BGRA input, linearizes it through
+ * a table, and resamples it to NumScanlines rows, all in a single pass.
+ * Equivalent to ConvertPlane() x3, Linearize() and VLanczos().
+ * Only columns [left,right) of scanlines [begin,end) are produced.
+ * The plane holds only columns [left,right) of scanlines [top,top+rows).
+ */
+static void ConvertInput(unsigned in_width, unsigned in_height, unsigned NumScanlines,
+                         const std::uint32_t* pixels, float* plane, unsigned radius,
+                         unsigned begin, unsigned end, unsigned left, unsigned right,
+                         unsigned top, unsigned rows)
 {
-    HorizScaler<const float*, float*> handler_x(in_width,out_width, in_height, in, out);
-    LanczosScale(in_width, out_width, handler_x);
+    if(in_height == NumScanlines)
+    {
+        const float* table = LinearTable();
+        const std::size_t stride = std::size_t(rows) * (right-left);
+        #pragma omp parallel for schedule(static)
+        for(unsigned y=begin; y<end; ++y)
+        {
+            float* out = plane + std::size_t(y-top) * (right-left);
+            ConvertRow(right-left, pixels + std::size_t(y) * in_width + left,
+                       out + stride*0, out + stride*1, out + stride*2, table);
+        }
+        return;
+    }
+    InputScaler handler(in_width, pixels, plane, top, rows, left, right);
+    if(radius == 1) LanczosScale<1>(in_height, NumScanlines, handler, begin, end);
+    else            LanczosScale<2>(in_height, NumScanlines, handler, begin, end);
 }
 
 static std::uint32_t ClampWithDesaturation(int r,int g,int b)
@@ -392,93 +608,542 @@ static std::uint32_t ClampWithDesaturation(int r,int g,int b)
     return unsigned(r)*65536u + unsigned(g)*256u + b;
 }
 
+/* Parameters that only affect the speed of the filter, not its result.
+ * They can be measured for the machine and the geometry with --autotune (see autotune.hh).
+ */
+struct Tuning
+{
+    unsigned threads   = 0;      // Worker threads, 0 = one per CPU
+    unsigned band_rows = 32;     // Output rows per band in ConvertPictureRect()
+    unsigned frames    = 0;      // Frames filtered at once in server mode, 0 = half the threads
+};
+static Tuning CurrentTuning;
 
-void ConvertPicture(unsigned in_width,
-                    unsigned in_height,
-                    unsigned out_width,
-                    unsigned out_height,
-                    unsigned NumScanlines,
-                    const std::uint32_t* pixels,
-                    std::uint32_t* outpixels)
+/* Runs func(begin, count) for chunks of [0,num) in parallel. */
+template<typename F>
+static void ParallelChunks(unsigned num, F&& func)
 {
-    std::vector<float> plane(NumScanlines * in_width * 3);
-    std::vector<float> tempplane(TotalVertRes * out_width * 3);
-    std::vector<float> resuplane(out_width * out_height * 3);
-    constexpr float Gamma = 2.0;
+    constexpr unsigned ChunkSize = 16384;
+    #pragma omp parallel for schedule(static)
+    for(unsigned begin=0; begin<num; begin+=ChunkSize)
+        func(begin, std::min(num-begin, ChunkSize));
+}
 
-    if(in_height == NumScanlines)
+/* Un-gammacorrects 0..255 values into linear 0..1 values. */
+KERNEL static void Linearize(unsigned num, float* data)
+{
+    #pragma omp simd
+    for(unsigned n=0; n<num; ++n)
+        data[n] = std::pow(data[n] / 255.f, 1.0 / Gamma);
+}
+
+KERNEL static void Normalize(unsigned num, float* data, float factor)
+{
+    #pragma omp simd
+    for(unsigned n=0; n<num; ++n)
+        data[n] = (data[n] /*+ 0.075f*/) * factor;
+}
+
+/* Gamma-corrects linear values into amplified integer values. */
+KERNEL static void GammaCorrect(unsigned num, const float* input, short* output, float amplify)
+{
+    #pragma omp simd
+    for(unsigned n=0; n<num; ++n)
+        output[n] = amplify * std::pow(input[n], Gamma);
+}
+
+static void BlurPlane(const short* input, short* output, short* temp,
+                      unsigned w,unsigned h, float sigma, unsigned scale)
+{
+    scaled_blur<3>(input, output, temp, w, h, sigma, scale);
+}
+/* Same as BlurPlane() for all channels of interleaved RGBx pixels at once. */
+static void BlurPlaneRGBx(const short* input, short* output, short* temp,
+                          unsigned w,unsigned h, float sigma, unsigned scale)
+{
+    scaled_blur<3,4>(input, output, temp, w, h, sigma, scale);
+}
+
+/* Normalizes and gamma-corrects linear values into the source of the bloom.
+ * Same as Normalize() followed by GammaCorrect() with amplify=600.
+ */
+KERNEL static void BloomSource(unsigned num, const float* input, short* output, float factor)
+{
+    #pragma omp simd
+    for(unsigned n=0; n<num; ++n)
+        output[n] = 600.f * std::pow(input[n] * factor, Gamma);
+}
+
+/* Normalizes and gamma-corrects the picture, adds the bloom into it,
+ * and clamps and packs the result, all in one pass.
+ * Same as Normalize(), GammaCorrect() with amplify=255, and ClampPlanes().
+ */
+KERNEL static void ComposeRow(unsigned num, unsigned picture_stride, unsigned bloom_stride,
+                              const float* picture, const short* bloom, float factor,
+                              std::uint32_t* outpixels)
+{
+    for(unsigned n=0; n<num; ++n)
     {
-        ConvertPlane<16>(NumScanlines*in_width, pixels, &plane[NumScanlines*in_width*0 + 0]);
-        ConvertPlane< 8>(NumScanlines*in_width, pixels, &plane[NumScanlines*in_width*1 + 0]);
-        ConvertPlane< 0>(NumScanlines*in_width, pixels, &plane[NumScanlines*in_width*2 + 0]);
+        short r = 255.f * std::pow(picture[picture_stride*0+n] * factor, Gamma);
+        short g = 255.f * std::pow(picture[picture_stride*1+n] * factor, Gamma);
+        short b = 255.f * std::pow(picture[picture_stride*2+n] * factor, Gamma);
+        outpixels[n] = ClampWithDesaturation(r + bloom[bloom_stride*0+n],
+                                             g + bloom[bloom_stride*1+n],
+                                             b + bloom[bloom_stride*2+n]);
+    }
+}
 
-        #pragma omp parallel for simd schedule(static)
-        for(unsigned n=0; n<NumScanlines*in_width*3; ++n)
-            plane[n] = std::pow(plane[n] / 255.f, 1.0 / Gamma);
+/* Same as ComposeRow(), for interleaved RGBx pixels. */
+KERNEL static void ComposeRowRGBx(unsigned num, const float* picture, const short* bloom, float factor,
+                                  std::uint32_t* outpixels)
+{
+    for(unsigned n=0; n<num; ++n)
+    {
+        short r = 255.f * std::pow(picture[n*4+0] * factor, Gamma);
+        short g = 255.f * std::pow(picture[n*4+1] * factor, Gamma);
+        short b = 255.f * std::pow(picture[n*4+2] * factor, Gamma);
+        outpixels[n] = ClampWithDesaturation(r + bloom[n*4+0],
+                                             g + bloom[n*4+1],
+                                             b + bloom[n*4+2]);
     }
-    else
+}
+
+/* Adds the bloom into the picture, and clamps and packs the result. */
+KERNEL static void ClampPlanes(unsigned num, unsigned stride,
+                               const short* picture, const short* bloom,
+                               std::uint32_t* outpixels)
+{
+    for(unsigned n=0; n<num; ++n)
+        outpixels[n] = ClampWithDesaturation(picture[stride*0+n] + bloom[stride*0+n],
+                                             picture[stride*1+n] + bloom[stride*1+n],
+                                             picture[stride*2+n] + bloom[stride*2+n]);
+}
+
+
+/* Options of ConvertPicture().
+ * The defaults produce the full quality picture using the fast paths.
+ * Reference() produces the same picture using the original, unfused code,
+ * against which the fast paths are verified (see compare.hh).
+ * The real-time mode trades quality for speed when it falls behind.
+ */
+struct FilterOptions
+{
+    unsigned LanczosRadius = 2;    // Kernel radius of the Lanczos filters (1 or 2)
+    unsigned BloomScale    = 1;    // Bloom is computed at 1/BloomScale resolution
+    unsigned VertStep      = 1;    // Only every VertStep'th intermediate row is rendered (1 or 2)
+    bool     FusedInput    = true; // Use ConvertInput() rather than separate passes
+    bool     FusedOutput   = true; // Use ComposeOutput() rather than separate passes
+    unsigned Bands         = 0;    // Bands of rows in each stage; 0 = NumBands()
+    bool     FoldVertical  = false; // Go from scanlines straight to output rows (see FoldedRow)
+    bool     Interleaved   = false; // Keep the picture as interleaved RGBx pixels rather than planes (with FusedOutput)
+
+    static FilterOptions Reference()
     {
-        std::vector<float> indata(in_width * in_height * 3);
-        ConvertPlane<16>(in_height*in_width, pixels, &indata[in_height*in_width*0 + 0]);
-        ConvertPlane< 8>(in_height*in_width, pixels, &indata[in_height*in_width*1 + 0]);
-        ConvertPlane< 0>(in_height*in_width, pixels, &indata[in_height*in_width*2 + 0]);
+        FilterOptions result;
+        result.FusedInput  = false;
+        result.FusedOutput = false;
+        return result;
+    }
+};
+
+/* Fused output back end: Everything after the final vertical Lanczos.
+ * The picture (3 planes of linear values, picture_stride apart, of which
+ * band_width x band_height are used) is read twice: once for producing
+ * the bloom, and once for composing the output.
+ * The bloom is blurred in place.
+ * The width x height pixels at (left,top) of the band are written into outpixels,
+ * whose rows are out_stride pixels apart.
+ */
+static void ComposeOutput(unsigned band_width, unsigned band_height,
+                          const float* picture, unsigned picture_stride, float factor, float sigma,
+                          std::uint32_t* outpixels, unsigned out_stride, unsigned bloomscale,
+                          unsigned left, unsigned top, unsigned width, unsigned height)
+{
+    const unsigned stride = band_width * band_height;
+    std::vector<short> bloom(stride * 3), bloomtmp(stride * 3);
 
-        #pragma omp parallel for simd schedule(static)
-        for(unsigned n=0; n<in_height*in_width*3; ++n)
-            indata[n] = std::pow(indata[n] / 255.f, 1.0 / Gamma);
+    for(unsigned n=0; n<3; ++n)
+        ParallelChunks(stride, [&](unsigned begin, unsigned num)
+        {
+            BloomSource(num, &picture[n*picture_stride + begin], &bloom[n*stride + begin], factor);
+        });
+
+    #pragma omp parallel for schedule(static)
+    for(unsigned n=0; n<3; ++n)
+        BlurPlane(&bloom[n*stride], &bloom[n*stride], &bloomtmp[n*stride],
+                  band_width, band_height, sigma, bloomscale);
 
-        #pragma omp parallel for schedule(dynamic)
-        for(unsigned n=0; n<3; ++n)
-            VLanczos(in_width,in_height, NumScanlines, &indata[in_height*in_width*n], &plane[NumScanlines*in_width*n]);
+    if(width == out_stride)
+    {
+        // Whole rows, so the output is contiguous.
+        const unsigned offset = top * band_width;
+        ParallelChunks(height * width, [&](unsigned begin, unsigned num)
+        {
+            ComposeRow(num, picture_stride, stride, &picture[offset+begin], &bloom[offset+begin], factor, &outpixels[begin]);
+        });
+        return;
+    }
+    #pragma omp parallel for schedule(static)
+    for(unsigned y=0; y<height; ++y)
+    {
+        const unsigned offset = (top+y) * band_width + left;
+        ComposeRow(width, picture_stride, stride, &picture[offset], &bloom[offset], factor, &outpixels[y * out_stride]);
     }
+}
+
+/* Same as ComposeOutput(), for a picture of interleaved RGBx pixels.
+ * The bloom is also interleaved, and its channels are blurred together.
+ */
+static void ComposeOutputRGBx(unsigned band_width, unsigned band_height,
+                              const float* picture, float factor, float sigma,
+                              std::uint32_t* outpixels, unsigned out_stride, unsigned bloomscale,
+                              unsigned left, unsigned top, unsigned width, unsigned height)
+{
+    const unsigned stride = band_width * band_height;
+    std::vector<short> bloom(stride * 4), bloomtmp(stride * 4);
+
+    ParallelChunks(stride * 4, [&](unsigned begin, unsigned num)
+    {
+        BloomSource(num, &picture[begin], &bloom[begin], factor);
+    });
 
+    BlurPlaneRGBx(&bloom[0], &bloom[0], &bloomtmp[0], band_width, band_height, sigma, bloomscale);
+
+    if(width == out_stride)
+    {
+        // Whole rows, so the output is contiguous.
+        const unsigned offset = top * band_width;
+        ParallelChunks(height * width, [&](unsigned begin, unsigned num)
+        {
+            ComposeRowRGBx(num, &picture[(offset+begin)*4], &bloom[(offset+begin)*4], factor, &outpixels[begin]);
+        });
+        return;
+    }
     #pragma omp parallel for schedule(static)
-    for(unsigned y=0; y<TotalVertRes; ++y)
+    for(unsigned y=0; y<height; ++y)
+    {
+        const unsigned offset = (top+y) * band_width + left;
+        ComposeRowRGBx(width, &picture[offset*4], &bloom[offset*4], factor, &outpixels[y * out_stride]);
+    }
+}
+
+/* Pixels of each stage that are needed for producing
+ * a rectangle of output pixels. Ranges are [begin,end).
+ */
+struct BandSupport
+{
+    unsigned out_begin,  out_end;   // Output rows, including the margin for bloom
+    unsigned mid_begin,  mid_end;   // Intermediate rows (after VertStep)
+    unsigned scan_begin, scan_end;  // Scanlines
+    unsigned in_begin,   in_end;    // Input rows
+    unsigned out_left,   out_right; // Output columns, including the margin for bloom
+    unsigned mid_left,   mid_right; // Intermediate columns
+    unsigned in_left,    in_right;  // Input columns
+    bool     vedge, hedge;          // Some stage was clipped by the top/bottom or left/right edge
+};
+
+static unsigned ScanlineOf(unsigned y, unsigned NumScanlines)
+{
+    // Same calculation as in ConvertPicture().
+    return unsigned(y * float(float(NumScanlines) / TotalVertRes));
+}
+
+static BandSupport ComputeBandSupport(unsigned in_width, unsigned in_height,
+                                      unsigned out_width, unsigned out_height, unsigned NumScanlines,
+                                      unsigned x0, unsigned x1, unsigned y0, unsigned y1,
+                                      const FilterOptions& options)
+{
+    const unsigned VertRes = TotalVertRes / options.VertStep;
+    const unsigned margin  = blur_support<3>(out_width / 640.f, options.BloomScale);
+
+    BandSupport res;
+    res.vedge     = y0 < margin || y1 + margin > out_height;
+    res.out_begin = y0 < margin ? 0 : y0 - margin;
+    res.out_begin -= res.out_begin % options.BloomScale; // Align the grid of scaled_blur()
+    res.out_end   = std::min(out_height, y1 + margin);
+
+    auto mid = LanczosSupport(options.LanczosRadius, VertRes, out_height, res.out_begin, res.out_end);
+    res.vedge    |= mid.clipped;
+    res.mid_begin = mid.begin;
+    res.mid_end   = mid.end;
+
+    res.scan_begin = ScanlineOf(res.mid_begin * options.VertStep, NumScanlines);
+    res.scan_end   = ScanlineOf((res.mid_end-1) * options.VertStep, NumScanlines) + 1;
+
+    if(in_height == NumScanlines)
     {
-        float srcy_flt = y * float(float(NumScanlines) / TotalVertRes);
-        unsigned srcy = unsigned(srcy_flt);
+        res.in_begin = res.scan_begin;
+        res.in_end   = res.scan_end;
+    }
+    else
+    {
+        auto in = LanczosSupport(options.LanczosRadius, in_height, NumScanlines, res.scan_begin, res.scan_end);
+        res.vedge   |= in.clipped;
+        res.in_begin = in.begin;
+        res.in_end   = in.end;
+    }
 
-        float ScaledScanline[TotalHorizRes/*in_width*/ * 3];
-        float XScaledScanline[TotalHorizRes * 3];
-        float XMask[TotalHorizRes * 3];
+    res.hedge     = x0 < margin || x1 + margin > out_width;
+    res.out_left  = x0 < margin ? 0 : x0 - margin;
+    res.out_left -= res.out_left % options.BloomScale;
+    res.out_right = std::min(out_width, x1 + margin);
 
-        float factor = ScanlineMagnitude(srcy_flt - srcy);
+    auto hmid = LanczosSupport(options.LanczosRadius, TotalHorizRes, out_width, res.out_left, res.out_right);
+    res.hedge    |= hmid.clipped;
+    res.mid_left  = hmid.begin;
+    res.mid_right = hmid.end;
 
-        #pragma omp simd collapse(2)
-        for(unsigned n=0; n<3; ++n)
-            for(unsigned x=0; x<in_width; ++x)
-            {
-                ScaledScanline[x + in_width*n] = plane[NumScanlines*in_width*n + srcy*in_width + x] * factor;
-            }
+    // Same calculation as in ConvertPicture().
+    res.in_left   = res.mid_left * in_width / TotalHorizRes;
+    res.in_right  = (res.mid_right-1) * in_width / TotalHorizRes + 1;
+    return res;
+}
 
-        #pragma omp simd
-        for(unsigned x=0; x<TotalHorizRes; ++x)
+/* Buffer for the intermediate results of ConvertPictureRect().
+ * The pages are mapped fresh from the kernel, so they read as zero,
+ * and each page is placed on the NUMA node of the thread that
+ * first writes it (first touch): the task that produces that band.
+ * (std::vector would zero all of it on the calling thread.)
+ */
+template<typename T>
+static std::shared_ptr<T[]> NewPlane(std::size_t num)
+{
+    std::size_t bytes = std::max<std::size_t>(num * sizeof(T), 1);
+    void* ptr = mmap(nullptr, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED) throw std::bad_alloc();
+    return std::shared_ptr<T[]>((T*)ptr, [bytes](T* p) { munmap(p, bytes); });
+}
+
+/* Buffer number which of ConvertPictureRect(), with room for num elements.
+ * The buffers are kept for the next call on the same thread, rather than
+ * mapped and faulted in again for every rectangle (tiles, scrolled rows).
+ * They only grow, and their contents are left over from the previous call.
+ * Their pages stay on the nodes of the workers that first wrote them,
+ * even though the bands of later calls may run on other workers.
+ */
+static float* StageBuffer(unsigned which, std::size_t num)
+{
+    struct Buffer { std::shared_ptr<float[]> data; std::size_t size = 0; };
+    thread_local Buffer buffers[4];
+    Buffer& b = buffers[which];
+    if(num > b.size) { b.data = NewPlane<float>(num); b.size = num; }
+    return b.data.get();
+}
+
+/* Bytes passed between the stages of ConvertPictureRect(),
+ * divided by whether the task that read them ran on the same NUMA node
+ * as the task that produced them, or on another node.
+ * This is not where the pages are: the stage buffers are reused
+ * (see StageBuffer()), and keep the placement of their first use.
+ */
+static struct
+{
+    std::atomic<unsigned long long> same_node{0}, other_node{0};
+} StageTraffic;
+
+/* Number of bands that each stage of ConvertPictureRect() is divided into. */
+static unsigned NumBands(unsigned rows)
+{
+    unsigned workers = TaskPool::Shared().Size();
+    if(workers <= 1) return 1;
+    return std::clamp(rows / CurrentTuning.band_rows, 1u, 4 * workers);
+}
+
+/* Horizontal Lanczos pass from TotalHorizRes to out_width.
+ * The contributions of each output column are the same on every row,
+ * so rather than being computed again for every row (and channel)
+ * by LanczosScale(), they are computed once per output width and radius.
+ * The columns are then produced by the same HorizScaler, so the result
+ * is identical to that of scaling each row with LanczosScale().
+ */
+class CachedHorizScaler
+{
+public:
+    static const CachedHorizScaler& Get(unsigned out_width, unsigned radius)
+    {
+        static std::mutex lock;
+        static std::map<std::array<unsigned,2>, std::unique_ptr<CachedHorizScaler>> scalers;
+        std::lock_guard<std::mutex> lk(lock);
+        auto& result = scalers[{out_width, radius}];
+        if(!result) result.reset(new CachedHorizScaler(out_width, radius));
+        return *result;
+    }
+
+    /* Produces the output columns [out_begin,out_end) from one row of input. */
+    void Row(const float* in, float* out, unsigned out_begin, unsigned out_end) const
+    {
+        HorizScaler<const float*, float*> handler(TotalHorizRes, out_end-out_begin, 1, in, out);
+        Replay(handler, out_begin, out_end);
+    }
+    /* Same, from one row of interleaved RGBx pixels. */
+    void RowRGBx(const float* in, float* out, unsigned out_begin, unsigned out_end) const
+    {
+        InterleavedHorizScaler handler(in, out);
+        Replay(handler, out_begin, out_end);
+    }
+
+private:
+    struct Column
+    {
+        int   start, nmax;
+        float density;
+    };
+    std::vector<Column> columns;
+    std::vector<float>  contrib; // taps per column
+    unsigned            taps;
+
+    template<typename Handler>
+    void Replay(const Handler& handler, unsigned out_begin, unsigned out_end) const
+    {
+        for(unsigned x=out_begin; x<out_end; ++x)
         {
-            XMask[x + TotalHorizRes*0] = GetMask<Cell0Start,Cell0End>(x,y);
-            XMask[x + TotalHorizRes*1] = GetMask<Cell1Start,Cell1End>(x,y);
-            XMask[x + TotalHorizRes*2] = GetMask<Cell2Start,Cell2End>(x,y);
+            const Column& c = columns[x];
+            handler.StripeLoop(x - out_begin, c.start, c.nmax, &contrib[std::size_t(x) * taps], c.density);
         }
+    }
 
-        #pragma omp simd collapse(1)
-        for(unsigned n=0; n<3; ++n)
-            for(unsigned x=0; x<TotalHorizRes; ++x)
-                XScaledScanline[x + TotalHorizRes*n] = ScaledScanline[x*in_width/TotalHorizRes + in_width*n];
+    /* Records the contributions that LanczosScale() computes.
+     * Using LanczosScale() itself, rather than repeating its calculation here,
+     * keeps the weights bit-identical to those of the row-by-row scaling.
+     */
+    struct Recorder
+    {
+        CachedHorizScaler& scaler;
+        void StripeLoop(int tx, int sx, int nmax, const float contrib[], float density) const
+        {
+            Column& c = scaler.columns[tx];
+            c.start = sx;
+            c.nmax  = nmax;
+            c.density = density;
+            std::copy_n(contrib, nmax, &scaler.contrib[std::size_t(tx) * scaler.taps]);
+        }
+    };
+    CachedHorizScaler(unsigned out_width, unsigned radius) : columns(out_width)
+    {
+        const float scale   = std::min(out_width / float(TotalHorizRes), 1.f);
+        const float support = radius / scale;
+        taps = std::min(TotalHorizRes, 5 + unsigned(2*support)); // As in LanczosScale()
+        contrib.resize(std::size_t(out_width) * taps);
+        Recorder recorder{*this};
+        if(radius == 1) LanczosScale<1>(TotalHorizRes, out_width, recorder);
+        else            LanczosScale<2>(TotalHorizRes, out_width, recorder);
+    }
+};
 
-        #pragma omp simd
-        for(unsigned x=0; x<TotalHorizRes; ++x)
+/* Weights of one output row of the vertical pass, folded together with
+ * the scanline profile and the rows of the mask.
+ * Intermediate row ty (at y = ty*VertStep) is the horizontal pass of
+ *   ScanlineMagnitude(fraction of y) * scanline(y) * mask row y,
+ * and by the mask phases, that is the sum over each phase p of
+ *   ScanlineMagnitude(fraction of y) * MaskLit(y,p) * H(scanline(y) * GetPhaseMask(p)).
+ * So each output row is a weighted sum of the horizontally scaled
+ * scanlines of each mask phase (the rows of the fold plane, where
+ * row (s-scan_begin)*NumMaskPhases + p is scanline s in phase p),
+ * and the intermediate rows need not be produced at all.
+ * The rows [first, first+weights.size()) of the fold plane are summed.
+ */
+struct FoldedRow
+{
+    unsigned           first;
+    std::vector<float> weights;
+};
+
+/* Lanczos handler that computes the FoldedRow of each output row. */
+class VertFolder
+{
+    std::vector<FoldedRow>& rows;
+    unsigned NumScanlines, VertStep, scan_begin;
+public:
+    VertFolder(std::vector<FoldedRow>& r, unsigned sl, unsigned step, unsigned scan)
+        : rows(r), NumScanlines(sl), VertStep(step), scan_begin(scan) { }
+
+    void StripeLoop(int tx, int sx, int nmax, const float contrib[], float density) const
+    {
+        const float density_rev = (density == 0.0f || density == 1.0f) ? 1.0f : (1.0f / density);
+        const unsigned first = ScanlineOf(sx * VertStep, NumScanlines);
+        const unsigned last  = ScanlineOf((sx + std::max(nmax,1) - 1) * VertStep, NumScanlines);
+
+        FoldedRow& row = rows[tx];
+        row.first = (first - scan_begin) * NumMaskPhases;
+        row.weights.assign((last - first + 1) * NumMaskPhases, 0.f);
+        for(int n=0; n<nmax; ++n)
         {
-            XScaledScanline[x + TotalHorizRes*0] *= XMask[x + TotalHorizRes*0];
-            XScaledScanline[x + TotalHorizRes*1] *= XMask[x + TotalHorizRes*1];
-            XScaledScanline[x + TotalHorizRes*2] *= XMask[x + TotalHorizRes*2];
+            // Same calculation as in ConvertPicture().
+            unsigned y = (sx + n) * VertStep;
+            float srcy_flt = y * float(float(NumScanlines) / TotalVertRes);
+            unsigned srcy = unsigned(srcy_flt);
+            float weight = contrib[n] * ScanlineMagnitude(srcy_flt - srcy) * density_rev;
+            for(unsigned p=0; p<NumMaskPhases; ++p)
+                if(MaskLit(y, p))
+                    row.weights[(srcy - first) * NumMaskPhases + p] += weight;
         }
+    }
+};
 
-        for(unsigned n=0; n<3; ++n)
-            HLanczos(TotalHorizRes,1, out_width, &XScaledScanline[TotalHorizRes*n], &tempplane[TotalVertRes*out_width*n + y*out_width]);
+/* Sums the rows of the fold plane (stride apart) by the weights. */
+KERNEL static void FoldRows(unsigned num, unsigned stride, const float* input, const float* weights, unsigned count, float* output)
+{
+    #pragma omp simd
+    for(unsigned x=0; x<num; ++x)
+    {
+        float res = 0.f;
+        for(unsigned k=0; k<count; ++k)
+            res += weights[k] * input[k*stride + x];
+        output[x] = res;
     }
+}
 
-    #pragma omp parallel for schedule(dynamic)
-    for(unsigned n=0; n<3; ++n)
-        VLanczos(out_width,TotalVertRes, out_height, &tempplane[TotalVertRes*out_width*n], &resuplane[out_height*out_width*n]);
+/* Produces the output pixels [x0,x1) x [y0,y1) into outpixels (which is a full frame).
+ * Only the parts of each stage that these pixels depend on are computed,
+ * and the result is identical to the same pixels of a full frame.
+ * Each stage is divided into bands of rows, run as a TaskGraph.
+ * If rows_done is given, it is called for each band of output rows
+ * as soon as it is complete, in order from top to bottom, on the calling thread.
+ */
+void ConvertPictureRect(unsigned in_width,
+                        unsigned in_height,
+                        unsigned out_width,
+                        unsigned out_height,
+                        unsigned NumScanlines,
+                        const std::uint32_t* pixels,
+                        std::uint32_t* outpixels,
+                        unsigned x0, unsigned x1, unsigned y0, unsigned y1,
+                        const FilterOptions& options = {},
+                        const std::function<void(unsigned y0, unsigned y1)>& rows_done = nullptr)
+{
+    const unsigned VertRes = TotalVertRes / options.VertStep;
+    const BandSupport band = ComputeBandSupport(in_width, in_height, out_width, out_height, NumScanlines,
+                                                x0, x1, y0, y1, options);
+    const unsigned mid_rows = band.mid_end - band.mid_begin;
+    const unsigned out_rows = band.out_end - band.out_begin;
+    const unsigned out_cols = band.out_right - band.out_left;
+    const unsigned margin   = blur_support<3>(out_width / 640.f, options.BloomScale);
+
+    const unsigned fold_rows = (band.scan_end - band.scan_begin) * NumMaskPhases;
+
+    // After the horizontal pass, the picture is either in three planes,
+    // or in one plane of interleaved RGBx pixels, which the vertical pass
+    // treats as one plane four times as wide.
+    const bool     rgbx       = options.Interleaved && options.FusedOutput;
+    const unsigned channels   = rgbx ? 4 : 3;
+    const unsigned planes     = rgbx ? 1 : 3;
+    const unsigned row_floats = out_cols * channels / planes;
+
+    // The scanlines: only columns [in_left,in_right) of scanlines [scan_begin,scan_end)
+    // with the fused front end. scanline(n, y)[x - plane_left] is column x of scanline y.
+    const unsigned plane_left  = options.FusedInput ? band.in_left : 0;
+    const unsigned plane_width = options.FusedInput ? band.in_right - band.in_left : in_width;
+    const unsigned plane_top   = options.FusedInput ? band.scan_begin : 0;
+    const unsigned plane_rows  = options.FusedInput ? band.scan_end - band.scan_begin : NumScanlines;
+
+    float* plane     = StageBuffer(0, std::size_t(plane_rows) * plane_width * 3);
+    float* tempplane = StageBuffer(1, options.FoldVertical ? 0 : std::size_t(mid_rows) * out_cols * channels);
+    float* foldplane = StageBuffer(2, options.FoldVertical ? std::size_t(fold_rows) * out_cols * channels : 0);
+    float* resuplane = StageBuffer(3, std::size_t(out_rows) * out_cols * channels);
+    auto scanline = [&](unsigned n, unsigned y) -> const float*
+    {
+        return &plane[(std::size_t(plane_rows)*n + y-plane_top) * plane_width];
+    };
 
     unsigned hpix = CellWidth0 + CellBlank0 + CellWidth1 + CellBlank1 + CellWidth2 + CellBlank2;
     unsigned vpix = CellHeight0 + CellHeight1;
@@ -490,36 +1155,378 @@ void ConvertPicture(unsigned in_width,
         { facsum2 += 1; sum2 += ScanlineMagnitude(n/8.f); }
     float factor = facsum*facsum2 / (sum*sum2);
 
-    #pragma omp parallel for simd schedule(static)
-    for(unsigned n=0; n<out_width*out_height*3; ++n) resuplane[n] = (resuplane[n] /*+ 0.075f*/) * factor;
+    /* Bands of each stage: scanlines, intermediate rows, output rows
+     * of the vertical pass, and output rows that are produced.
+     * Each task depends on the tasks that produce the rows it reads.
+     * The NUMA node where each task ran is recorded, for StageTraffic.
+     */
+    TaskGraph graph;
+    struct Stage { std::vector<unsigned> bounds; std::vector<TaskGraph::TaskId> tasks; };
+    std::deque<int> ran_on;
+    std::deque<std::vector<std::pair<TaskGraph::TaskId, std::size_t>>> reads; // Bytes read from each task
+    auto add = [&](std::function<void()> func)
+    {
+        const TaskGraph::TaskId id = ran_on.size();
+        ran_on.push_back(-1);
+        reads.emplace_back();
+        graph.Add([&, id, func = std::move(func)]
+        {
+            ran_on[id] = CurrentNode();
+            unsigned long long same_node = 0, other_node = 0;
+            for(auto& r: reads[id]) (ran_on[r.first] == ran_on[id] ? same_node : other_node) += r.second;
+            StageTraffic.same_node  += same_node;
+            StageTraffic.other_node += other_node;
+            func();
+        });
+        return id;
+    };
+    const unsigned nbands = options.Bands ? std::min(options.Bands, std::max(y1-y0, 1u)) : NumBands(out_rows);
+    auto split = [nbands](unsigned begin, unsigned end)
+    {
+        Stage stage;
+        for(unsigned k=0; k<=nbands; ++k) stage.bounds.push_back(begin + std::size_t(end-begin) * k / nbands);
+        return stage;
+    };
+    auto depend = [&](TaskGraph::TaskId task, const Stage& on, unsigned begin, unsigned end, std::size_t row_bytes)
+    {
+        for(unsigned k=0; k<on.tasks.size(); ++k)
+            if(on.bounds[k] < end && on.bounds[k+1] > begin)
+            {
+                graph.Depend(task, on.tasks[k]);
+                reads[task].emplace_back(on.tasks[k], (std::min(end, on.bounds[k+1]) - std::max(begin, on.bounds[k])) * row_bytes);
+            }
+    };
 
-    std::vector<short> resuplanes(out_width * out_height * 3);
-    std::vector<short> resuplanestmp(out_width * out_height * 3);
-    std::vector<short> resuplaneout(out_width * out_height * 3);
+    // Input
+    Stage input = options.FusedInput ? split(band.scan_begin, band.scan_end) : split(0, NumScanlines);
+    if(!options.FusedInput)
+    {
+        // The reference front end runs as one task.
+        input.bounds = { 0, NumScanlines };
+        input.tasks.push_back(add([&]
+        {
+            if(in_height == NumScanlines)
+            {
+                ConvertPlane<16>(NumScanlines*in_width, pixels, &plane[NumScanlines*in_width*0 + 0]);
+                ConvertPlane< 8>(NumScanlines*in_width, pixels, &plane[NumScanlines*in_width*1 + 0]);
+                ConvertPlane< 0>(NumScanlines*in_width, pixels, &plane[NumScanlines*in_width*2 + 0]);
+
+                ParallelChunks(NumScanlines*in_width*3, [&](unsigned begin, unsigned num)
+                {
+                    Linearize(num, &plane[begin]);
+                });
+                return;
+            }
+            std::vector<float> indata(in_width * in_height * 3);
+            ConvertPlane<16>(in_height*in_width, pixels, &indata[in_height*in_width*0 + 0]);
+            ConvertPlane< 8>(in_height*in_width, pixels, &indata[in_height*in_width*1 + 0]);
+            ConvertPlane< 0>(in_height*in_width, pixels, &indata[in_height*in_width*2 + 0]);
 
-    #pragma omp parallel for simd schedule(static)
-    for(unsigned n=0; n<out_width*out_height*3; ++n)
-        resuplanes[n] = 600.f * std::pow(resuplane[n], Gamma);
+            ParallelChunks(in_height*in_width*3, [&](unsigned begin, unsigned num)
+            {
+                Linearize(num, &indata[begin]);
+            });
 
-    for(unsigned n=0; n<3; ++n)
+            #pragma omp parallel for schedule(dynamic)
+            for(unsigned n=0; n<3; ++n)
+                VLanczos(in_width,in_height, NumScanlines, &indata[in_height*in_width*n], &plane[NumScanlines*in_width*n], options.LanczosRadius);
+        }));
+    }
+    else
+        for(unsigned k=0; k<nbands; ++k)
+            input.tasks.push_back(add([&, begin = input.bounds[k], end = input.bounds[k+1]]
+            {
+                ConvertInput(in_width, in_height, NumScanlines, pixels, plane, options.LanczosRadius,
+                             begin, end, band.in_left, band.in_right, plane_top, plane_rows);
+            }));
+
+    // Horizontal pass of one row of one channel
+    const CachedHorizScaler& hscaler = CachedHorizScaler::Get(out_width, options.LanczosRadius);
+    auto hscale = [&](const float* in, float* out)
+    {
+        hscaler.Row(in, out, band.out_left, band.out_right);
+    };
+    auto hscale_rgbx = [&](const float* in, float* out)
+    {
+        hscaler.RowRGBx(in, out, band.out_left, band.out_right);
+    };
+    // Interleaves the intermediate columns of three planes into RGBx pixels.
+    auto interleave = [&](const float* in, float* out)
+    {
+        #pragma omp simd
+        for(unsigned x=band.mid_left; x<band.mid_right; ++x)
+        {
+            out[x*4+0] = in[x + TotalHorizRes*0];
+            out[x*4+1] = in[x + TotalHorizRes*1];
+            out[x*4+2] = in[x + TotalHorizRes*2];
+            out[x*4+3] = 0.f;
+        }
+    };
+
+    // Intermediate rows: scanline profile, mask and horizontal pass
+    Stage horiz = split(band.mid_begin, band.mid_end);
+    for(unsigned k=0; k<nbands && !options.FoldVertical; ++k)
     {
-        blur<3>(&resuplanes[n*out_width*out_height],
-                &resuplaneout[n*out_width*out_height],
-                &resuplanestmp[n*out_width*out_height],
-                out_width, out_height, out_width / 640.f);
+        const unsigned begin = horiz.bounds[k], end = horiz.bounds[k+1];
+        horiz.tasks.push_back(add([&, begin, end]
+        {
+            #pragma omp parallel for schedule(static)
+            for(unsigned ty=begin; ty<end; ++ty)
+            {
+                unsigned y = ty * options.VertStep;
+                float srcy_flt = y * float(float(NumScanlines) / TotalVertRes);
+                unsigned srcy = unsigned(srcy_flt);
+
+                float ScaledScanline[TotalHorizRes/*in_width*/ * 3];
+                float XScaledScanline[TotalHorizRes * 3];
+                float XMask[TotalHorizRes * 3];
+
+                float factor = ScanlineMagnitude(srcy_flt - srcy);
+
+                #pragma omp simd collapse(2)
+                for(unsigned n=0; n<3; ++n)
+                    for(unsigned x=band.in_left; x<band.in_right; ++x)
+                    {
+                        ScaledScanline[x + in_width*n] = scanline(n, srcy)[x - plane_left] * factor;
+                    }
+
+                #pragma omp simd
+                for(unsigned x=band.mid_left; x<band.mid_right; ++x)
+                {
+                    XMask[x + TotalHorizRes*0] = GetMask<Cell0Start,Cell0End>(x,y);
+                    XMask[x + TotalHorizRes*1] = GetMask<Cell1Start,Cell1End>(x,y);
+                    XMask[x + TotalHorizRes*2] = GetMask<Cell2Start,Cell2End>(x,y);
+                }
+
+                #pragma omp simd collapse(1)
+                for(unsigned n=0; n<3; ++n)
+                    for(unsigned x=band.mid_left; x<band.mid_right; ++x)
+                        XScaledScanline[x + TotalHorizRes*n] = ScaledScanline[x*in_width/TotalHorizRes + in_width*n];
+
+                #pragma omp simd
+                for(unsigned x=band.mid_left; x<band.mid_right; ++x)
+                {
+                    XScaledScanline[x + TotalHorizRes*0] *= XMask[x + TotalHorizRes*0];
+                    XScaledScanline[x + TotalHorizRes*1] *= XMask[x + TotalHorizRes*1];
+                    XScaledScanline[x + TotalHorizRes*2] *= XMask[x + TotalHorizRes*2];
+                }
+
+                if(rgbx)
+                {
+                    float XScaledPixels[TotalHorizRes * 4];
+                    interleave(XScaledScanline, XScaledPixels);
+                    hscale_rgbx(XScaledPixels, &tempplane[(ty-band.mid_begin)*out_cols*4]);
+                }
+                else
+                    for(unsigned n=0; n<3; ++n)
+                        hscale(&XScaledScanline[TotalHorizRes*n], &tempplane[mid_rows*out_cols*n + (ty-band.mid_begin)*out_cols]);
+            }
+        }));
+        if(begin < end)
+            depend(horiz.tasks.back(), input, ScanlineOf(begin * options.VertStep, NumScanlines),
+                                              ScanlineOf((end-1) * options.VertStep, NumScanlines) + 1,
+                   plane_width * 3 * sizeof(float));
     }
 
-    #pragma omp parallel for simd schedule(static)
-    for(unsigned n=0; n<out_width*out_height*3; ++n)
-        resuplanes[n] = 255.f * std::pow(resuplane[n], Gamma);
 
-    #pragma omp parallel for schedule(static)
-    for(unsigned n=0; n<out_width*out_height; ++n)
+    // With FoldVertical, instead: mask phases and horizontal pass of each scanline
+    Stage fold = split(band.scan_begin, band.scan_end);
+    for(unsigned k=0; k<nbands && options.FoldVertical; ++k)
     {
-        outpixels[n] = ClampWithDesaturation(resuplanes[out_height*out_width*0+n] + resuplaneout[out_height*out_width*0+n],
-                                             resuplanes[out_height*out_width*1+n] + resuplaneout[out_height*out_width*1+n],
-                                             resuplanes[out_height*out_width*2+n] + resuplaneout[out_height*out_width*2+n]);
+        const unsigned begin = fold.bounds[k], end = fold.bounds[k+1];
+        fold.tasks.push_back(add([&, begin, end]
+        {
+            #pragma omp parallel for schedule(static)
+            for(unsigned srcy=begin; srcy<end; ++srcy)
+            {
+                float ScaledScanline[TotalHorizRes/*in_width*/ * 3];
+                float XScaledScanline[TotalHorizRes * 3];
+
+                #pragma omp simd collapse(2)
+                for(unsigned n=0; n<3; ++n)
+                    for(unsigned x=band.in_left; x<band.in_right; ++x)
+                    {
+                        ScaledScanline[x + in_width*n] = scanline(n, srcy)[x - plane_left];
+                    }
+
+                for(unsigned p=0; p<NumMaskPhases; ++p)
+                {
+                    #pragma omp simd
+                    for(unsigned x=band.mid_left; x<band.mid_right; ++x)
+                    {
+                        XScaledScanline[x + TotalHorizRes*0] = ScaledScanline[x*in_width/TotalHorizRes + in_width*0] * GetPhaseMask<Cell0Start,Cell0End>(x,p);
+                        XScaledScanline[x + TotalHorizRes*1] = ScaledScanline[x*in_width/TotalHorizRes + in_width*1] * GetPhaseMask<Cell1Start,Cell1End>(x,p);
+                        XScaledScanline[x + TotalHorizRes*2] = ScaledScanline[x*in_width/TotalHorizRes + in_width*2] * GetPhaseMask<Cell2Start,Cell2End>(x,p);
+                    }
+
+                    const unsigned row = (srcy-band.scan_begin)*NumMaskPhases + p;
+                    if(rgbx)
+                    {
+                        float XScaledPixels[TotalHorizRes * 4];
+                        interleave(XScaledScanline, XScaledPixels);
+                        hscale_rgbx(XScaledPixels, &foldplane[row*out_cols*4]);
+                    }
+                    else
+                        for(unsigned n=0; n<3; ++n)
+                            hscale(&XScaledScanline[TotalHorizRes*n], &foldplane[fold_rows*out_cols*n + row*out_cols]);
+                }
+            }
+        }));
+        if(begin < end)
+            depend(fold.tasks.back(), input, begin, end,
+                   plane_width * 3 * sizeof(float));
     }
+
+    // Vertical pass
+    Stage vert = split(band.out_begin, band.out_end);
+    std::vector<FoldedRow> folded(options.FoldVertical ? out_rows : 0);
+    for(unsigned k=0; k<nbands; ++k)
+    {
+        const unsigned begin = vert.bounds[k], end = vert.bounds[k+1];
+        vert.tasks.push_back(add([&, begin, end]
+        {
+            if(options.FoldVertical)
+            {
+                VertFolder folder(folded, NumScanlines, options.VertStep, band.scan_begin);
+                BandHandler<VertFolder> handler(folder, 0, band.out_begin);
+                if(options.LanczosRadius == 1) LanczosScale<1>(VertRes, out_height, handler, begin, end);
+                else                           LanczosScale<2>(VertRes, out_height, handler, begin, end);
+
+                #pragma omp parallel for schedule(static)
+                for(unsigned y=begin; y<end; ++y)
+                {
+                    const FoldedRow& row = folded[y - band.out_begin];
+                    for(unsigned n=0; n<planes; ++n)
+                        FoldRows(row_floats, row_floats, &foldplane[fold_rows*row_floats*n + row.first*row_floats],
+                                 &row.weights[0], row.weights.size(),
+                                 &resuplane[out_rows*row_floats*n + (y - band.out_begin)*row_floats]);
+                }
+                return;
+            }
+            for(unsigned n=0; n<planes; ++n)
+            {
+                const float* src = &tempplane[mid_rows*row_floats*n];
+                float*       tgt = &resuplane[out_rows*row_floats*n];
+                VertScaler<const float*, float*> handler_y(row_floats, src, tgt);
+                BandHandler<decltype(handler_y)> handler(handler_y, band.mid_begin, band.out_begin);
+                if(options.LanczosRadius == 1) LanczosScale<1>(VertRes, out_height, handler, begin, end);
+                else                           LanczosScale<2>(VertRes, out_height, handler, begin, end);
+            }
+        }));
+        if(begin < end)
+        {
+            auto mid = LanczosSupport(options.LanczosRadius, VertRes, out_height, begin, end);
+            if(options.FoldVertical)
+                depend(vert.tasks.back(), fold, ScanlineOf(mid.begin * options.VertStep, NumScanlines),
+                                                ScanlineOf((mid.end-1) * options.VertStep, NumScanlines) + 1,
+                       NumMaskPhases * out_cols * channels * sizeof(float));
+            else
+                depend(vert.tasks.back(), horiz, mid.begin, mid.end, out_cols * channels * sizeof(float));
+        }
+    }
+
+    outpixels += x0;
+    if(!options.FusedOutput)
+    {
+        // The reference back end runs as one task.
+        TaskGraph::TaskId task = add([&]
+        {
+            const unsigned stride = out_cols * out_rows;
+            ParallelChunks(stride*3, [&](unsigned begin, unsigned num)
+            {
+                Normalize(num, &resuplane[begin], factor);
+            });
+
+            std::vector<short> resuplanes(stride * 3);
+            std::vector<short> resuplanestmp(stride * 3);
+            std::vector<short> resuplaneout(stride * 3);
+
+            ParallelChunks(stride*3, [&](unsigned begin, unsigned num)
+            {
+                GammaCorrect(num, &resuplane[begin], &resuplanes[begin], 600.f);
+            });
+
+            for(unsigned n=0; n<3; ++n)
+            {
+                BlurPlane(&resuplanes[n*stride],
+                          &resuplaneout[n*stride],
+                          &resuplanestmp[n*stride],
+                          out_cols, out_rows, out_width / 640.f, options.BloomScale);
+            }
+
+            ParallelChunks(stride*3, [&](unsigned begin, unsigned num)
+            {
+                GammaCorrect(num, &resuplane[begin], &resuplanes[begin], 255.f);
+            });
+
+            const unsigned left = x0 - band.out_left, top = y0 - band.out_begin;
+            #pragma omp parallel for schedule(static)
+            for(unsigned y=0; y<y1-y0; ++y)
+            {
+                const unsigned offset = (top+y) * out_cols + left;
+                ClampPlanes(x1-x0, stride, &resuplanes[offset], &resuplaneout[offset], &outpixels[(y0+y) * out_width]);
+            }
+        });
+        depend(task, vert, band.out_begin, band.out_end, out_cols * channels * sizeof(float));
+        graph.Run();
+        if(rows_done) rows_done(y0, y1);
+        return;
+    }
+
+    // Bloom and pack. The bloom of each band is computed over a margin around it.
+    // Completed bands are reported in order, by the calling thread
+    // (rows_done may block, e.g. writing into a pipe).
+    Stage pack = split(y0, y1);
+    std::mutex reported_lock;
+    std::vector<bool> packed(nbands);
+    unsigned completed = 0, reported = 0; // Bands complete in order, bands given to rows_done
+    auto report = [&]
+    {
+        unsigned upto;
+        { std::lock_guard<std::mutex> lk(reported_lock); upto = completed; }
+        for(; reported < upto; ++reported)
+            rows_done(pack.bounds[reported], pack.bounds[reported+1]);
+    };
+    for(unsigned k=0; k<nbands; ++k)
+    {
+        const unsigned begin = pack.bounds[k], end = pack.bounds[k+1];
+        unsigned first = std::max(band.out_begin + margin, begin) - margin;
+        first -= (first - band.out_begin) % options.BloomScale; // Align the grid of scaled_blur()
+        const unsigned last = std::min(band.out_end, end + margin);
+        pack.tasks.push_back(add([&, k, begin, end, first, last]
+        {
+            if(rgbx)
+                ComposeOutputRGBx(out_cols, last - first, &resuplane[(first - band.out_begin) * out_cols * 4],
+                                  factor, out_width / 640.f, &outpixels[begin * out_width], out_width, options.BloomScale,
+                                  x0 - band.out_left, begin - first, x1 - x0, end - begin);
+            else
+                ComposeOutput(out_cols, last - first, &resuplane[(first - band.out_begin) * out_cols], out_rows*out_cols,
+                              factor, out_width / 640.f, &outpixels[begin * out_width], out_width, options.BloomScale,
+                              x0 - band.out_left, begin - first, x1 - x0, end - begin);
+            if(!rows_done) return;
+            { std::lock_guard<std::mutex> lk(reported_lock);
+              for(packed[k] = true; completed < nbands && packed[completed]; ) ++completed; }
+            graph.Wake();
+        }));
+        if(begin < end)
+            depend(pack.tasks.back(), vert, first, last, out_cols * channels * sizeof(float));
+    }
+    graph.Run(report);
+    report(); // The bands completed by the last tasks
+}
+
+void ConvertPicture(unsigned in_width,
+                    unsigned in_height,
+                    unsigned out_width,
+                    unsigned out_height,
+                    unsigned NumScanlines,
+                    const std::uint32_t* pixels,
+                    std::uint32_t* outpixels,
+                    const FilterOptions& options = {},
+                    const std::function<void(unsigned y0, unsigned y1)>& rows_done = nullptr)
+{
+    ConvertPictureRect(in_width, in_height, out_width, out_height, NumScanlines,
+                       pixels, outpixels, 0, out_width, 0, out_height, options, rows_done);
 }
 
 static long FullyWrite(int fd, const void* b, std::size_t length) // SafeWrite
@@ -537,6 +1544,30 @@ static long FullyWrite(int fd, const void* b, std::size_t length) // SafeWrite
     if(length) goto Retry;
     return buf-origbuf;
 }
+/* Same as FullyWrite(), but the pages are spliced into the pipe
+ * rather than copied (vmsplice). The buffer must not be modified
+ * afterwards; see NewFrame(). Falls back to FullyWrite() if fd
+ * is not a pipe.
+ */
+static long FullySplice(int fd, const void* b, std::size_t length)
+{
+    const unsigned char* buf = (const unsigned char*) b;
+    auto origbuf = buf;
+  Retry:;
+    struct iovec iov = { (void*)buf, length };
+    long result = vmsplice(fd, &iov, 1, 0);
+    if(result == -1 && errno==EAGAIN) goto Retry;
+    if(result == -1 && errno==EINTR) goto Retry;
+    if(result == -1 && errno==EBADF && buf == origbuf) return FullyWrite(fd, b, length);
+    if(result == -1 && errno==EINVAL && buf == origbuf) return FullyWrite(fd, b, length);
+    if(result == 0) { std::fprintf(stderr, "\33[1mvmsplice: EOF\33[m\n"); return 0; }
+    if(result < 0) { std::perror("vmsplice"); return -(long)errno; }
+    length -= result;
+    buf    += result;
+    if(length) goto Retry;
+    return buf-origbuf;
+}
+
 static long FullyRead(int fd, void* b, std::size_t length) // SafeRead
 {
     unsigned char* buf = (unsigned char*) b;
@@ -553,52 +1584,150 @@ static long FullyRead(int fd, void* b, std::size_t length) // SafeRead
     return buf-origbuf;
 }
 
+/* Limits of the geometry, wherever it comes from (the commandline,
+ * a FRAME header, a client of the server). The input width is limited
+ * by the scanline buffers of ConvertPictureRect(), and each frame
+ * to MaxFramePixels.
+ * Returns nullptr if the geometry is acceptable, otherwise the reason.
+ */
+constexpr unsigned long MaxDimension   = 16384;
+constexpr unsigned long MaxFramePixels = 1ul << 26; // 256 MB per frame
+static const char* CheckInputGeometry(unsigned long in_width, unsigned long in_height, unsigned long NumScanlines)
+{
+    if(!in_width || !in_height || !NumScanlines) return "Zero size";
+    if(in_width > TotalHorizRes)                 return "Input wider than the emulated screen";
+    if(NumScanlines > TotalVertRes)              return "More scanlines than the emulated screen has rows";
+    if(in_height > MaxDimension || in_width * in_height > MaxFramePixels)
+        return "Input frame too large";
+    return nullptr;
+}
+static const char* CheckGeometry(unsigned long in_width, unsigned long in_height,
+                                 unsigned long out_width, unsigned long out_height,
+                                 unsigned long NumScanlines)
+{
+    if(const char* error = CheckInputGeometry(in_width, in_height, NumScanlines)) return error;
+    if(!out_width || !out_height) return "Zero size";
+    if(out_width > MaxDimension || out_height > MaxDimension || out_width * out_height > MaxFramePixels)
+        return "Output frame too large";
+    return nullptr;
+}
+
+#include "fingerprint.hh"
+#include "packframe.hh"
+#include "framecache.hh"
+#include "frameinput.hh"
+#include "frameoutput.hh"
+#include "realtime.hh"
+#include "sparse.hh"
+#include "scroll.hh"
+#include "tiles.hh"
+#include "stream.hh"
+#include "framed.hh"
+#include "slices.hh"
+#include "server.hh"
+#include "distribute.hh"
+#include "compare.hh"
+#include "autotune.hh"
+
 int main(int argc, char** argv)
 {
-    if(argc != 6)
+    double realtime_fps = 0;
+    bool   compare = false, splice = false, autotune = false, pin = false, framed = false, framed_output = false;
+    unsigned long start_frame = 0, frame_count = ULONG_MAX;
+    unsigned tolerance = 0, priority = 1, slices = 0;
+    const char* serve = nullptr, *connect = nullptr, *distribute = nullptr;
+    StreamOptions stream;
+    std::vector<const char*> args, corpus_files, compare_paths;
+    for(int a=1; a<argc; ++a)
+    {
+        std::string_view opt = argv[a];
+        if(opt == "--realtime" && a+1 < argc) realtime_fps = std::atof(argv[++a]);
+        else if(opt == "--compare")           compare = true;
+        else if(opt == "--vmsplice")          splice = true;
+        else if(opt == "--no-scroll")         stream.scroll = false;
+        else if(opt == "--scroll")            stream.moved_rows = true;
+        else if(opt == "--no-sparse")         stream.sparse = false;
+        else if(opt == "--stats")             stream.stats = true;
+        else if(opt == "--fold")              stream.filter.FoldVertical = true;
+        else if(opt == "--interleaved")       stream.filter.Interleaved = true;
+        else if(opt == "--pin")               pin = true;
+        else if(opt == "--autotune")          autotune = true;
+        else if(opt == "--framed")            framed = true;
+        else if(opt == "--framed-output")     framed_output = true;
+        else if(opt == "--tiles" && a+1 < argc) std::sscanf(argv[++a], "%ux%u", &stream.tile_width, &stream.tile_height);
+        else if(opt == "--tolerance" && a+1 < argc) tolerance = std::atoi(argv[++a]);
+        else if(opt == "--cache-mb" && a+1 < argc)  stream.cache_mb = std::atoi(argv[++a]);
+        else if(opt == "--start-frame" && a+1 < argc) start_frame = std::strtoul(argv[++a], nullptr, 10);
+        else if(opt == "--frame-count" && a+1 < argc) frame_count = std::strtoul(argv[++a], nullptr, 10);
+        else if(opt == "--corpus" && a+1 < argc) corpus_files.push_back(argv[++a]);
+        else if(opt == "--path" && a+1 < argc)   compare_paths.push_back(argv[++a]);
+        else if(opt == "--serve" && a+1 < argc)    serve = argv[++a];
+        else if(opt == "--connect" && a+1 < argc)  connect = argv[++a];
+        else if(opt == "--distribute" && a+1 < argc) distribute = argv[++a];
+        else if(opt == "--priority" && a+1 < argc) priority = std::atoi(argv[++a]);
+        else if(opt == "--slices" && a+1 < argc)   slices = std::atoi(argv[++a]);
+        else args.push_back(argv[a]);
+    }
+    if(serve && args.empty())
+    {
+        if(pin) TaskPool::Shared().Pin();
+        return Server(stream, tolerance).Run(serve);
+    }
+    if(args.size() != 5)
     {
         std::fprintf(stderr, "\33[1mInvalid parameters.\n"
-                             "crt-filter <in-width> <in-height> <out-width> <out-height> <numscanlines>\33[m\n");
+                             "crt-filter [--realtime <fps>] [--vmsplice] [--start-frame <n>] [--frame-count <n>] [--tolerance <n>] [--cache-mb <n>] [--scroll] [--no-scroll]\n"
+                             "           [--tiles <w>x<h>] [--no-sparse] [--stats] [--pin] [--framed] [--framed-output] [--slices <n>] [--fold] [--interleaved]\n"
+                             "           <in-width> <in-height> <out-width> <out-height> <numscanlines>\n"
+                             "crt-filter --compare [--corpus <file>]... [--path <name>]... <in-width> <in-height> <out-width> <out-height> <numscanlines>\n"
+                             "crt-filter --serve <socket>|<host>:<port> [--tolerance <n>] [--cache-mb <n>] [--scroll] [--no-scroll] [--tiles <w>x<h>] [--no-sparse] [--stats] [--pin] [--fold] [--interleaved]\n"
+                             "           [<in-width> <in-height> <out-width> <out-height> <numscanlines>]\n"
+                             "crt-filter --connect <socket> [--priority <n>] [--vmsplice] <in-width> <in-height> <out-width> <out-height> <numscanlines>\n"
+                             "crt-filter --distribute <host>:<port>[,<host>:<port>...] [--tolerance <n>] [--vmsplice] [--framed-output] [--start-frame <n>] [--frame-count <n>]\n"
+                             "           <in-width> <in-height> <out-width> <out-height> <numscanlines>\n"
+                             "crt-filter --autotune <in-width> <in-height> <out-width> <out-height> <numscanlines>\33[m\n");
         return 1;
     }
-    unsigned in_width  = std::atoi(argv[1]);
-    unsigned in_height = std::atoi(argv[2]);
-    unsigned out_width  = std::atoi(argv[3]);
-    unsigned out_height = std::atoi(argv[4]);
-    unsigned NumScanlines = std::atoi(argv[5]);
-    std::vector<std::uint32_t> inbuf(in_width*in_height);
-    std::vector<std::uint32_t> outbuf(out_width*out_height);
-
-    constexpr unsigned NFrames = 4;
-    newhash_t                  hashes[NFrames];
-    std::vector<std::uint32_t> saved_outputs[NFrames];
-    std::vector<std::uint32_t> saved_inputs[NFrames];
-    for(;;)
-    {
-        if(FullyRead(0, &inbuf[0], inbuf.size()*4) < (long)inbuf.size()*4) break;
-
-        newhash_t hash = newhash_calc((const unsigned char*)&inbuf[0],
-                                      inbuf.size()*sizeof(inbuf[0]));
-        bool found = false;
-        for(unsigned n=0; n<NFrames; ++n)
-            if(hash == hashes[n] && inbuf == saved_inputs[n])
-            {
-                outbuf = saved_outputs[n];
-                found  = true;
-                break;
-            }
-        if(!found)
-        {
-            ConvertPicture(in_width, in_height, out_width, out_height, NumScanlines, &inbuf[0], &outbuf[0]);
-
-            static unsigned n = 0;
-            saved_inputs[n]  = inbuf;
-            saved_outputs[n] = outbuf;
-            hashes[n]        = hash;
-            n = (n+1)%NFrames;
-        }
-
-        if(FullyWrite(1, &outbuf[0], outbuf.size()*4) < (long)outbuf.size()*4) break;
+    unsigned long sizes[5];
+    for(unsigned n=0; n<5; ++n) sizes[n] = std::strtoul(args[n], nullptr, 10);
+    if(const char* error = CheckGeometry(sizes[0], sizes[1], sizes[2], sizes[3], sizes[4]))
+    {
+        std::fprintf(stderr, "crt-filter: %s: %s %s %s %s %s\n", error, args[0], args[1], args[2], args[3], args[4]);
+        return 1;
     }
-    return 0;
+    unsigned in_width  = sizes[0];
+    unsigned in_height = sizes[1];
+    unsigned out_width  = sizes[2];
+    unsigned out_height = sizes[3];
+    unsigned NumScanlines = sizes[4];
+
+    if(autotune)
+        return RunAutotune(in_width, in_height, out_width, out_height, NumScanlines);
+    LoadProfile(in_width, in_height, out_width, out_height, NumScanlines);
+    if(pin) TaskPool::Shared().Pin();
+    if(serve) // Tuned for this geometry
+        return Server(stream, tolerance).Run(serve);
+
+    if(compare)
+        return RunCompare(in_width, in_height, out_width, out_height, NumScanlines, corpus_files, compare_paths);
+    auto write_frame = splice ? FullySplice : FullyWrite;
+    if(connect)
+        return RunClient(connect, in_width, in_height, out_width, out_height, NumScanlines, priority, write_frame);
+
+    FrameOutput output(1, out_width, out_height, write_frame, framed_output);
+    if(framed)
+        return FilterFramedStream(in_width, in_height, out_width, out_height, NumScanlines, stream, tolerance, 0, output);
+
+    FrameInput input(0, in_width*in_height, start_frame, frame_count);
+    FrameCache cache(in_width, in_height, tolerance, out_width, out_height, std::size_t(stream.cache_mb) << 20);
+
+    if(distribute)
+        return Coordinator(in_width, in_height, out_width, out_height, NumScanlines).Run(distribute, input, cache, output);
+    if(slices)
+        return RunSlices(in_width, in_height, out_width, out_height, NumScanlines, slices, stream, input, cache, output);
+    if(realtime_fps > 0)
+        return RunRealtime(in_width, in_height, out_width, out_height, NumScanlines, realtime_fps, input, cache, output);
+
+    return FilterStream(in_width, in_height, out_width, out_height, NumScanlines, stream,
+                        input, cache, nullptr, output);
 }
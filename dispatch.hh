@@ -0,0 +1,42 @@
+#ifndef bqtCrtDispatchHH
+#define bqtCrtDispatchHH
+
+/* Runtime CPU dispatch.
+ *
+ * Functions marked KERNEL are compiled several times, once for each
+ * listed instruction set, and the dynamic linker picks the best clone
+ * for the running CPU at startup (GNU ifunc). This way one binary
+ * runs on any x86-64, but still uses AVX2 or AVX-512 where present.
+ * Everything that a kernel calls is inlined into it (flatten),
+ * so that the callees are compiled for the same instruction set.
+ *
+ * OpenMP parallel regions are outlined into separate functions
+ * which are not cloned. Therefore kernels must not contain
+ * "omp parallel"; they are called from within one instead.
+ *
+ * Build with -DNO_DISPATCH to disable (e.g. together with -march=native).
+ */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && !defined(NO_DISPATCH)
+# define KERNEL __attribute__((target_clones("default","sse4.2","avx2","avx512f"), flatten))
+# define HAVE_DISPATCH 1
+#elif defined(__GNUC__)
+# define KERNEL __attribute__((flatten))
+#else
+# define KERNEL
+#endif
+
+/* Names the instruction set whose clones are used on this CPU. */
+static inline const char* KernelTarget()
+{
+#ifdef HAVE_DISPATCH
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) return "avx512f";
+    if(__builtin_cpu_supports("avx2"))    return "avx2";
+    if(__builtin_cpu_supports("sse4.2"))  return "sse4.2";
+    return "default";
+#else
+    return "compile-time";
+#endif
+}
+
+#endif
@@ -0,0 +1,206 @@
+#include <deque>
+
+/* Distributed mode.
+ *
+ *   crt-filter --distribute <address>[,<address>...] [--tolerance <n>] <in-width> <in-height> <out-width> <out-height> <numscanlines>
+ *
+ * Spreads the filtering of one video over several machines.
+ * Each address is a server (crt-filter --serve <host>:<port>, see server.hh)
+ * that is used as a worker. The same address may be listed several times,
+ * for several streams into the same server.
+ *
+ * The coordinator reads the frames from stdin, and looks each up in
+ * a FrameCache exactly as in the offline mode, so a repeated frame is
+ * never sent over the network; it waits for the result of its first occurrence.
+ * Unique frames are sent to the worker with the fewest frames in flight.
+ * Every worker returns its frames in the order it received them,
+ * and the coordinator writes them to stdout in the original order.
+ * If a worker is lost, the frames it had not returned are sent to
+ * the remaining workers.
+ */
+class Coordinator
+{
+    static constexpr unsigned MaxInFlight = 4; // Frames sent to a worker but not returned
+
+    struct Job
+    {
+        FramePtr input, output;
+    };
+    using JobPtr = std::shared_ptr<Job>;
+
+    struct Link
+    {
+        std::string        address;
+        int                fd = -1;
+        bool               alive = false;
+        std::deque<JobPtr> inflight;
+        std::thread        receiver;
+        unsigned long      frames = 0;
+    };
+
+    unsigned in_width, in_height, out_width, out_height, NumScanlines;
+    std::mutex              lock;
+    std::condition_variable cond;
+    std::deque<Link>        links;
+    std::deque<JobPtr>      retry; // Frames of lost workers
+    unsigned long           retried = 0;
+
+public:
+    Coordinator(unsigned iw,unsigned ih, unsigned ow,unsigned oh, unsigned scanlines)
+        : in_width(iw), in_height(ih), out_width(ow), out_height(oh), NumScanlines(scanlines) { }
+
+    int Run(const char* addresses, FrameInput& input, FrameCache& cache, FrameOutput& out)
+    {
+        std::signal(SIGPIPE, SIG_IGN);
+        for(const char* a = addresses; *a; )
+        {
+            const char* end = std::strchr(a, ',');
+            if(!end) end = a + std::strlen(a);
+            Connect(std::string(a, end));
+            a = *end ? end+1 : end;
+        }
+        if(std::none_of(links.begin(), links.end(), [](const Link& l) { return l.alive; }))
+        {
+            std::fprintf(stderr, "crt-filter: No workers\n");
+            return 1;
+        }
+
+        JobPtr jobs[FrameCache::NFrames]; // For each slot of the cache
+        std::deque<JobPtr> order;          // Frames to be written, in order
+        unsigned long frames = 0, unique = 0;
+        bool ok = true;
+        for(FramePtr inframe; ok && (inframe = input.Next()); ++frames)
+        {
+            Fingerprint print = Fingerprint::Of(inframe.get(), in_width, in_height);
+            int slot = cache.Lookup(print, inframe.get());
+            if(slot < 0)
+            {
+                ++unique;
+                slot = cache.next;
+                jobs[slot] = std::make_shared<Job>();
+                jobs[slot]->input = inframe;
+                cache.Insert(print, std::move(inframe), nullptr);
+                ok = Dispatch(jobs[slot]);
+            }
+            order.push_back(jobs[slot]);
+            // Write what is done. Keep enough frames ahead to keep all workers busy.
+            ok = ok && Flush(order, links.size() * MaxInFlight * 2, out);
+        }
+        ok = ok && Flush(order, 0, out) && out.Flush();
+
+        for(auto& l: links)
+        {
+            std::fprintf(stderr, "crt-filter: %s: %lu frames%s\n", l.address.c_str(), l.frames, l.alive ? "" : " (lost)");
+            if(l.fd >= 0) shutdown(l.fd, SHUT_RDWR);
+            if(l.receiver.joinable()) l.receiver.join();
+            if(l.fd >= 0) close(l.fd);
+        }
+        std::fprintf(stderr, "crt-filter: %lu frames, %lu unique frames distributed, %lu resent\n", frames, unique, retried);
+        return ok ? 0 : 1;
+    }
+
+private:
+    void Connect(const std::string& address)
+    {
+        Link& l = links.emplace_back();
+        l.address = address;
+        if((l.fd = OpenSocket(address.c_str(), false)) < 0)
+        {
+            std::perror(address.c_str());
+            return;
+        }
+        char line[128];
+        int length = std::snprintf(line, sizeof(line), "%u %u %u %u %u\n",
+                                   in_width, in_height, out_width, out_height, NumScanlines);
+        if(FullyWrite(l.fd, line, length) < length)
+            return;
+        l.alive    = true;
+        l.receiver = std::thread([this,&l]{ Receive(l); });
+    }
+
+    /* Sends the job to the least busy worker. Returns false if there are no workers left. */
+    bool Dispatch(const JobPtr& job)
+    {
+        Link* link = nullptr;
+        { std::unique_lock<std::mutex> lk(lock);
+          cond.wait(lk, [&]
+          {
+              link = nullptr;
+              bool any = false;
+              for(auto& l: links)
+                  if(l.alive)
+                  {
+                      any = true;
+                      if(l.inflight.size() < MaxInFlight && (!link || l.inflight.size() < link->inflight.size()))
+                          link = &l;
+                  }
+              return link || !any;
+          });
+          if(!link)
+          {
+              std::fprintf(stderr, "crt-filter: All workers were lost\n");
+              return false;
+          }
+          link->inflight.push_back(job); }
+
+        // If this fails, the receiver finds out too, and the frame is resent.
+        if(FullyWrite(link->fd, job->input.get(), std::size_t(in_width)*in_height*4) < 0)
+            shutdown(link->fd, SHUT_RDWR);
+        return true;
+    }
+
+    /* Writes the finished frames at the front of order, until at most "keep" frames remain. */
+    bool Flush(std::deque<JobPtr>& order, std::size_t keep, FrameOutput& out)
+    {
+        while(!order.empty())
+        {
+            FramePtr output;
+            std::deque<JobPtr> resend;
+            { std::unique_lock<std::mutex> lk(lock);
+              cond.wait(lk, [&]{ return order.front()->output || order.size() <= keep || !retry.empty(); });
+              output = order.front()->output;
+              resend.swap(retry); }
+
+            for(auto& job: resend)
+            {
+                ++retried;
+                if(!Dispatch(job)) return false;
+            }
+            if(!output)
+            {
+                if(order.size() <= keep) return true;
+                continue;
+            }
+            order.pop_front();
+            if(!out.Write(output)) return false;
+        }
+        return true;
+    }
+
+    void Receive(Link& l)
+    {
+        const std::size_t out_bytes = std::size_t(out_width)*out_height*4;
+        for(;;)
+        {
+            auto frame = NewFrame(std::size_t(out_width)*out_height);
+            bool got = FullyRead(l.fd, frame.get(), out_bytes) == (long)out_bytes;
+            std::lock_guard<std::mutex> lk(lock);
+            if(!got || l.inflight.empty())
+            {
+                // Lost, or closed at the end. Resend whatever it had.
+                if(!l.inflight.empty())
+                    std::fprintf(stderr, "crt-filter: Lost worker %s, resending %zu frames\n", l.address.c_str(), l.inflight.size());
+                l.alive = false;
+                for(auto& job: l.inflight) retry.push_back(job);
+                l.inflight.clear();
+                cond.notify_all();
+                return;
+            }
+            l.inflight.front()->output = std::move(frame);
+            l.inflight.front()->input  = nullptr;
+            l.inflight.pop_front();
+            ++l.frames;
+            cond.notify_all();
+        }
+    }
+};
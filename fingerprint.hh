@@ -0,0 +1,107 @@
+#include <cstring>
+#include <vector>
+
+/* Fingerprints of input frames.
+ *
+ * The frame is divided into tiles of TileWidth x TileHeight pixels,
+ * and each tile is hashed into 64 bits. The tiles are hashed in parallel,
+ * and within a tile, each row is consumed 8 lanes of 64 bits at a time,
+ * which the compiler turns into SIMD multiplies. The tile hashes are
+ * combined into the 64-bit key of the frame, which is what FrameCache
+ * looks up. The tile hashes themselves are kept, so that changes
+ * between frames can be located without hashing again.
+ */
+struct Fingerprint
+{
+    static constexpr unsigned TileWidth = 64, TileHeight = 16;
+
+    std::uint64_t              key = 0;
+    unsigned                   tiles_x = 0, tiles_y = 0;
+    std::vector<std::uint64_t> tiles; // Row by row
+
+    static inline Fingerprint Of(const std::uint32_t* pixels, unsigned width, unsigned height);
+
+    /* Number of tiles that differ from those of another frame of the same size. */
+    unsigned Changed(const Fingerprint& other) const
+    {
+        if(other.tiles.size() != tiles.size()) return tiles.size();
+        unsigned result = 0;
+        for(std::size_t n=0; n<tiles.size(); ++n) result += tiles[n] != other.tiles[n];
+        return result;
+    }
+};
+
+KERNEL static std::uint64_t HashTile(const std::uint32_t* pixels, unsigned stride, unsigned width, unsigned height)
+{
+    constexpr unsigned      Lanes = 8;
+    constexpr std::uint64_t Prime = 0x9E3779B97F4A7C15u;
+    std::uint64_t acc[Lanes];
+    for(unsigned l=0; l<Lanes; ++l) acc[l] = Prime * (l+1);
+
+    for(unsigned y=0; y<height; ++y)
+    {
+        const std::uint32_t* row = pixels + std::size_t(y)*stride;
+        unsigned x = 0;
+        for(; x + 2*Lanes <= width; x += 2*Lanes)
+        {
+            #pragma omp simd
+            for(unsigned l=0; l<Lanes; ++l)
+            {
+                std::uint64_t v;
+                std::memcpy(&v, &row[x + 2*l], sizeof(v));
+                acc[l] = (acc[l] ^ v) * Prime;
+                acc[l] ^= acc[l] >> 29;
+            }
+        }
+        for(; x < width; ++x)
+        {
+            std::uint64_t& a = acc[x % Lanes];
+            a = (a ^ row[x]) * Prime;
+            a ^= a >> 29;
+        }
+    }
+
+    std::uint64_t result = std::uint64_t(width) << 32 | height;
+    for(unsigned l=0; l<Lanes; ++l)
+    {
+        result = (result ^ acc[l]) * 0xC2B2AE3D27D4EB4Fu;
+        result ^= result >> 31;
+    }
+    return result;
+}
+
+Fingerprint Fingerprint::Of(const std::uint32_t* pixels, unsigned width, unsigned height)
+{
+    Fingerprint result;
+    result.tiles_x = (width  + TileWidth-1)  / TileWidth;
+    result.tiles_y = (height + TileHeight-1) / TileHeight;
+    result.tiles.resize(std::size_t(result.tiles_x) * result.tiles_y);
+
+    #pragma omp parallel for schedule(static)
+    for(unsigned ty=0; ty<result.tiles_y; ++ty)
+        for(unsigned tx=0; tx<result.tiles_x; ++tx)
+        {
+            const unsigned x = tx*TileWidth, y = ty*TileHeight;
+            result.tiles[ty*result.tiles_x + tx] = HashTile(pixels + std::size_t(y)*width + x, width,
+                                                            std::min(TileWidth, width - x), std::min(TileHeight, height - y));
+        }
+
+    result.key = std::uint64_t(width) << 32 | height;
+    for(auto t: result.tiles)
+    {
+        result.key = (result.key ^ t) * 0x9E3779B97F4A7C15u;
+        result.key ^= result.key >> 29;
+    }
+    return result;
+}
+
+/* Compares two frames of num pixels, in parallel. */
+static bool FramesEqual(const std::uint32_t* a, const std::uint32_t* b, std::size_t num)
+{
+    constexpr std::size_t Chunk = 65536;
+    bool equal = true;
+    #pragma omp parallel for schedule(static) reduction(&&:equal)
+    for(std::size_t begin=0; begin<num; begin+=Chunk)
+        equal = equal && std::memcmp(a+begin, b+begin, std::min(Chunk, num-begin) * sizeof(*a)) == 0;
+    return equal;
+}
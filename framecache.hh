@@ -0,0 +1,217 @@
+#include <memory>
+#include <cstring>
+#include <deque>
+#include <new>
+
+/* Reference-counted frame.
+ * Frames are immutable once published, so that the same frame
+ * can be held by the cache and written to the output at the same time.
+ */
+using FramePtr = std::shared_ptr<const std::uint32_t>;
+
+/* Allocates an uninitialized frame of num pixels.
+ * Frames are mapped directly from the kernel rather than from the heap.
+ * When a frame is freed, its pages are therefore never handed out again
+ * while a pipe may still refer to them (see FullySplice()).
+ */
+static std::shared_ptr<std::uint32_t> NewFrame(std::size_t num)
+{
+    std::size_t bytes = num * sizeof(std::uint32_t);
+    void* ptr = mmap(nullptr, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED) throw std::bad_alloc();
+    return std::shared_ptr<std::uint32_t>((std::uint32_t*)ptr, [bytes](std::uint32_t* p) { munmap(p, bytes); });
+}
+
+/* Cache of recently produced frames.
+ * If the fingerprint and the contents of an input frame match a saved frame,
+ * the filtered result of that frame is reused.
+ * Frames are shared with the caller, never copied.
+ *
+ * With a nonzero tolerance, a frame whose every color channel differs
+ * from a saved frame by at most that much is also considered a match.
+ * This lets noisy sources (lossy codecs, rescaling) reuse results.
+ * Candidates are screened with per-tile signatures (channel sums of
+ * TileSize x TileSize pixels) before the pixels are compared.
+ *
+ * Frames evicted from the NFrames slots are kept compressed (see packframe.hh)
+ * in the archive, up to archive_limit bytes, oldest dropped first.
+ * A match from the archive is decompressed back into a slot.
+ * Lookup() only searches the slots.
+ */
+struct FrameCache
+{
+    static constexpr unsigned NFrames  = 4;
+    static constexpr unsigned TileSize = 16;
+
+    unsigned    width, height;
+    unsigned    tolerance;
+    std::uint64_t keys[NFrames] {}; // Fingerprint::key of each saved input
+    FramePtr    saved_outputs[NFrames];
+    FramePtr    saved_inputs[NFrames];
+    std::vector<std::uint32_t> signatures[NFrames]; // Only if tolerance > 0
+    bool        archived[NFrames] {}; // The slot was restored from the archive
+    unsigned    next = 0;
+
+    struct ArchivedFrame
+    {
+        std::uint64_t              key;
+        PackedFrame                input, output;
+        std::vector<std::uint32_t> signature; // Only if tolerance > 0
+        std::size_t Bytes() const { return input.Bytes() + output.Bytes() + signature.size() * sizeof(std::uint32_t); }
+    };
+    unsigned    out_width, out_height;
+    std::size_t archive_limit, archive_bytes = 0;
+    std::deque<ArchivedFrame> archive; // Least recently used first
+
+    unsigned long approximated = 0; // Number of tolerant matches
+    unsigned long restored     = 0; // Number of matches from the archive
+    std::size_t   packed_raw = 0, packed_bytes = 0; // Of every frame compressed so far
+
+    FrameCache(unsigned w, unsigned h, unsigned tol = 0, unsigned ow = 0, unsigned oh = 0, std::size_t limit = 0)
+        : width(w), height(h), tolerance(tol), out_width(ow), out_height(oh), archive_limit(ow && oh ? limit : 0) { }
+
+    FramePtr Find(const Fingerprint& print, const std::uint32_t* input)
+    {
+        int slot = Lookup(print, input);
+        return slot < 0 ? Restore(print, input) : saved_outputs[slot];
+    }
+    /* Same as Find(), but returns the index of the matching slot, or -1. */
+    int Lookup(const Fingerprint& print, const std::uint32_t* input)
+    {
+        for(unsigned n=0; n<NFrames; ++n)
+            if(saved_inputs[n] && print.key == keys[n]
+            && FramesEqual(input, saved_inputs[n].get(), std::size_t(width)*height))
+                return n;
+        if(tolerance)
+        {
+            auto signature = Signature(input);
+            for(unsigned n=0; n<NFrames; ++n)
+                if(saved_inputs[n]
+                && SignaturesMatch(signature, signatures[n])
+                && MaxDelta(input, saved_inputs[n].get()) <= tolerance)
+                {
+                    ++approximated;
+                    return n;
+                }
+        }
+        return -1;
+    }
+    /* Saves a frame into slot number "next". */
+    void Insert(const Fingerprint& print, FramePtr input, FramePtr output)
+    {
+        std::vector<std::uint32_t> signature;
+        if(tolerance)
+            signature = Signature(input.get());
+        Store(print.key, std::move(input), std::move(output), std::move(signature), false);
+    }
+
+private:
+    void Store(std::uint64_t key, FramePtr input, FramePtr output, std::vector<std::uint32_t>&& signature, bool from_archive)
+    {
+        if(archive_limit && saved_outputs[next] && !archived[next])
+            Archive(next);
+        signatures[next]    = std::move(signature);
+        saved_inputs[next]  = std::move(input);
+        saved_outputs[next] = std::move(output);
+        keys[next]          = key;
+        archived[next]      = from_archive;
+        next = (next+1)%NFrames;
+    }
+
+    void Archive(unsigned slot)
+    {
+        ArchivedFrame a{ keys[slot],
+                         PackedFrame::Pack(saved_inputs[slot].get(), width, height),
+                         PackedFrame::Pack(saved_outputs[slot].get(), out_width, out_height),
+                         signatures[slot] };
+        packed_raw   += a.input.RawBytes() + a.output.RawBytes();
+        packed_bytes += a.input.Bytes() + a.output.Bytes();
+        archive_bytes += a.Bytes();
+        archive.push_back(std::move(a));
+        while(archive_bytes > archive_limit)
+        {
+            archive_bytes -= archive.front().Bytes();
+            archive.pop_front();
+        }
+    }
+
+    /* Searches the archive, most recently used first. A match is
+     * decompressed into a slot, and becomes the most recently used.
+     */
+    FramePtr Restore(const Fingerprint& print, const std::uint32_t* input)
+    {
+        if(archive.empty()) return nullptr;
+        const std::size_t num = std::size_t(width) * height;
+        auto candidate = NewFrame(num);
+        std::vector<std::uint32_t> signature;
+        if(tolerance) signature = Signature(input);
+        for(auto i = archive.end(); i-- != archive.begin(); )
+        {
+            bool keyed = i->key == print.key;
+            if(!keyed && !(tolerance && SignaturesMatch(signature, i->signature)))
+                continue;
+            i->input.Unpack(candidate.get());
+            bool exact = keyed && FramesEqual(input, candidate.get(), num);
+            if(!exact && !(tolerance && MaxDelta(input, candidate.get()) <= tolerance))
+                continue;
+            if(!exact) ++approximated;
+            ++restored;
+
+            auto output = NewFrame(std::size_t(out_width) * out_height);
+            i->output.Unpack(output.get());
+            ArchivedFrame a = std::move(*i);
+            archive.erase(i);
+            archive.push_back(std::move(a));
+            Store(archive.back().key, std::move(candidate), output, std::vector<std::uint32_t>(archive.back().signature), true);
+            return output;
+        }
+        return nullptr;
+    }
+
+    unsigned TilesX() const { return (width  + TileSize-1) / TileSize; }
+    unsigned TilesY() const { return (height + TileSize-1) / TileSize; }
+
+    /* Sums of R, G and B over each tile. */
+    std::vector<std::uint32_t> Signature(const std::uint32_t* input) const
+    {
+        std::vector<std::uint32_t> result(TilesX() * TilesY() * 3);
+        #pragma omp parallel for schedule(static)
+        for(unsigned ty=0; ty<TilesY(); ++ty)
+            for(unsigned y=ty*TileSize; y<std::min(height, (ty+1)*TileSize); ++y)
+                for(unsigned x=0; x<width; ++x)
+                {
+                    std::uint32_t p = input[y*width + x], *sum = &result[(ty*TilesX() + x/TileSize) * 3];
+                    sum[0] += (p >> 16) & 0xFF;
+                    sum[1] += (p >>  8) & 0xFF;
+                    sum[2] += (p >>  0) & 0xFF;
+                }
+        return result;
+    }
+
+    /* If every channel of every pixel differs by at most tolerance,
+     * no tile sum can differ by more than tolerance times its pixel count.
+     */
+    bool SignaturesMatch(const std::vector<std::uint32_t>& a, const std::vector<std::uint32_t>& b) const
+    {
+        const std::uint32_t limit = tolerance * TileSize * TileSize;
+        for(std::size_t n=0; n<a.size(); ++n)
+            if((a[n] > b[n] ? a[n] - b[n] : b[n] - a[n]) > limit)
+                return false;
+        return true;
+    }
+
+    /* Largest difference of any color channel of any pixel. */
+    unsigned MaxDelta(const std::uint32_t* a, const std::uint32_t* b) const
+    {
+        unsigned result = 0;
+        const std::size_t num = std::size_t(width) * height;
+        #pragma omp parallel for simd schedule(static) reduction(max:result)
+        for(std::size_t n=0; n<num; ++n)
+            for(unsigned shift=0; shift<24; shift+=8)
+            {
+                int d = int((a[n] >> shift) & 0xFF) - int((b[n] >> shift) & 0xFF);
+                result = std::max(result, unsigned(std::abs(d)));
+            }
+        return result;
+    }
+};
@@ -0,0 +1,160 @@
+/* Framed input.
+ *
+ *   crt-filter --framed [options] <in-width> <in-height> <out-width> <out-height> <numscanlines>
+ *
+ * Each input frame is preceded by a header line, in the manner of YUV4MPEG2:
+ *
+ *   FRAME [W<width>] [H<height>] [S<numscanlines>] [R<count>]\n
+ *   <width*height BGRA pixels>
+ *
+ *   REPEAT <count>\n
+ *
+ * A FRAME header gives the geometry of that frame. Omitted fields are
+ * the same as in the previous frame (initially, the commandline).
+ * R is the number of times that the frame is output (default 1).
+ * REPEAT outputs the previous output frame count more times,
+ * without any pixels being sent or hashed.
+ * A count is at most MaxRepeat (see frameoutput.hh), and the geometry
+ * is limited as on the commandline (see CheckInputGeometry()).
+ * The output size stays fixed.
+ *
+ * The filtering state (StreamFilter, FrameCache) is kept for every
+ * geometry seen, so switching between e.g. a 640x400 text mode
+ * and a 320x200 graphics mode costs nothing after the first switch.
+ */
+struct FramedHeader
+{
+    unsigned      width, height, NumScanlines;
+    unsigned long repeat = 1;
+    bool          pixels = true; // False for REPEAT
+};
+
+class FramedInput
+{
+    int                            fd;
+    FramedHeader                   current;
+    std::shared_ptr<std::uint32_t> buffer;
+    std::size_t                    buffer_pixels = 0;
+
+public:
+    FramedInput(int f, unsigned width, unsigned height, unsigned NumScanlines)
+        : fd(f), current{width, height, NumScanlines} { }
+
+    /* Reads the next header, and the pixels of the frame if there are any.
+     * Returns nullptr at end of input or on error; header.pixels tells which.
+     */
+    FramePtr Next(FramedHeader& header)
+    {
+        char line[256];
+        std::size_t length = 0;
+        for(;;)
+        {
+            if(read(fd, &line[length], 1) != 1) return Fail(header, length ? "Truncated header" : nullptr);
+            if(line[length] == '\n') break;
+            if(++length == sizeof(line)) return Fail(header, "Header too long");
+        }
+        line[length] = '\0';
+
+        header = current;
+        header.repeat = 1;
+        header.pixels = true;
+        if(std::strncmp(line, "REPEAT ", 7) == 0)
+        {
+            header.pixels = false;
+            header.repeat = std::strtoul(line+7, nullptr, 10);
+            if(header.repeat > MaxRepeat) return Fail(header, "REPEAT count too large");
+            return nullptr;
+        }
+        if(std::strncmp(line, "FRAME", 5) != 0 || (line[5] != ' ' && line[5] != '\0'))
+            return Fail(header, "Expected FRAME or REPEAT");
+        unsigned long width = header.width, height = header.height, NumScanlines = header.NumScanlines;
+        for(char* p = line+5; *p; )
+        {
+            if(*p == ' ') { ++p; continue; }
+            char tag = *p++;
+            unsigned long value = std::strtoul(p, &p, 10);
+            switch(tag)
+            {
+                case 'W': width         = value; break;
+                case 'H': height        = value; break;
+                case 'S': NumScanlines  = value; break;
+                case 'R': header.repeat = value; break;
+                default: return Fail(header, "Unknown tag in FRAME");
+            }
+        }
+        if(const char* error = CheckInputGeometry(width, height, NumScanlines))
+            return Fail(header, error);
+        if(header.repeat > MaxRepeat)
+            return Fail(header, "R count too large");
+        header.width        = width;
+        header.height       = height;
+        header.NumScanlines = NumScanlines;
+        current = header;
+
+        const std::size_t pixels = std::size_t(header.width) * header.height;
+        if(!buffer || buffer.use_count() > 1 || buffer_pixels != pixels)
+            { buffer = NewFrame(pixels); buffer_pixels = pixels; }
+        if(FullyRead(fd, buffer.get(), pixels*4) < (long)(pixels*4))
+            return Fail(header, "Truncated frame");
+        return buffer;
+    }
+
+private:
+    static FramePtr Fail(FramedHeader& header, const char* message)
+    {
+        if(message) std::fprintf(stderr, "crt-filter: Framed input: %s\n", message);
+        header.pixels = true;
+        return nullptr;
+    }
+};
+
+static int FilterFramedStream(unsigned in_width, unsigned in_height,
+                              unsigned out_width, unsigned out_height,
+                              unsigned NumScanlines, const StreamOptions& options, unsigned tolerance,
+                              int in_fd, FrameOutput& out)
+{
+    struct Geometry
+    {
+        FrameCache                    cache;
+        std::unique_ptr<StreamFilter> filter;
+        unsigned long                 frames = 0;
+    };
+    std::map<std::array<unsigned,3>, std::unique_ptr<Geometry>> geometries;
+
+    FramedInput input(in_fd, in_width, in_height, NumScanlines);
+    FramedHeader header;
+    FramePtr output;
+    unsigned long repeats = 0;
+    for(bool ok = true; ok; )
+    {
+        FramePtr inframe = input.Next(header);
+        if(inframe)
+        {
+            auto& g = geometries[{header.width, header.height, header.NumScanlines}];
+            if(!g)
+            {
+                char name[64];
+                std::snprintf(name, sizeof(name), "crt-filter: %ux%u/%u", header.width, header.height, header.NumScanlines);
+                g.reset(new Geometry{FrameCache(header.width, header.height, tolerance, out_width, out_height,
+                                                std::size_t(options.cache_mb) << 20), nullptr});
+                g->filter = std::make_unique<StreamFilter>(header.width, header.height, out_width, out_height,
+                                                           header.NumScanlines, options, g->cache, nullptr, name);
+            }
+            output = g->filter->Filter(std::move(inframe), g->frames++);
+        }
+        else if(header.pixels)
+            break;
+        if(!output) continue; // REPEAT before the first frame
+        if(!header.pixels) repeats += header.repeat;
+        for(unsigned long n=0; ok && n<header.repeat; ++n)
+            ok = out.Write(output);
+    }
+    out.Flush();
+    for(auto& g: geometries)
+        g.second->filter->Report();
+    std::fprintf(stderr, "crt-filter: %lu frames written, %lu by REPEAT, %zu geometries\n", out.frames, repeats, geometries.size());
+    if(out.repeated)
+        std::fprintf(stderr, "crt-filter: %lu of %lu frames written as repeats\n", out.repeated, out.frames);
+    ReportStageTraffic(options, "crt-filter");
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include <sys/stat.h>
+#include <climits>
+
+/* Source of input frames.
+ *
+ * If the input is a regular file, it is mapped into memory
+ * from its current position onwards (as if it were read),
+ * and the frames are hashed and filtered in place, without copying.
+ * Otherwise the frames are read, reusing the buffer of the previous frame
+ * if nobody else holds it anymore.
+ *
+ * The frames before start are skipped (seeked over, if possible),
+ * and at most count frames are produced.
+ */
+class FrameInput
+{
+    int                            fd;
+    std::size_t                    frame_pixels;
+    unsigned long                  next, end;   // Frame numbers
+    std::shared_ptr<const char>    mapping;     // Whole file, if mapped
+    std::size_t                    map_start = 0; // Offset of the first frame in mapping
+    std::size_t                    map_frames = 0;
+    std::shared_ptr<std::uint32_t> buffer;      // For reading, if not mapped
+
+public:
+    FrameInput(int f, std::size_t pixels, unsigned long start = 0, unsigned long count = ULONG_MAX)
+        : fd(f), frame_pixels(pixels), next(start),
+          end(count > ULONG_MAX - start ? ULONG_MAX : start + count)
+    {
+        const std::size_t frame_bytes = frame_pixels * 4;
+        struct stat st;
+        const off_t here = lseek(fd, 0, SEEK_CUR); // The input starts here, as when reading
+        if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && here != (off_t)-1 && st.st_size > here)
+        {
+            // The mapping must start at a page boundary.
+            const off_t page = here - here % sysconf(_SC_PAGESIZE);
+            std::size_t size = st.st_size - page;
+            void* ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, page);
+            if(ptr != MAP_FAILED)
+            {
+                madvise(ptr, size, MADV_SEQUENTIAL);
+                mapping.reset((const char*)ptr, [size](const char* p) { munmap((void*)p, size); });
+                map_start  = here - page;
+                map_frames = (st.st_size - here) / frame_bytes;
+                return;
+            }
+            // Seekable, but not mappable: Seek to the first frame.
+            if(lseek(fd, off_t(next * frame_bytes), SEEK_CUR) != (off_t)-1)
+                return;
+        }
+        // Not seekable: Read the frames before start and discard them.
+        for(; next > 0; --next, --end)
+            if(!Read())
+                { end = 0; break; }
+    }
+
+    /* Returns the next frame, or nullptr at end of input. */
+    FramePtr Next()
+    {
+        if(next >= end) return nullptr;
+        if(mapping)
+        {
+            if(next >= map_frames) return nullptr;
+            const char* frame = mapping.get() + map_start + next++ * frame_pixels * 4;
+            return FramePtr(mapping, (const std::uint32_t*)frame);
+        }
+        ++next;
+        return Read();
+    }
+
+private:
+    FramePtr Read()
+    {
+        if(!buffer || buffer.use_count() > 1)
+            buffer = NewFrame(frame_pixels);
+        if(FullyRead(fd, buffer.get(), frame_pixels*4) < (long)(frame_pixels*4))
+            return nullptr;
+        return buffer;
+    }
+};
@@ -0,0 +1,100 @@
+/* Destination of output frames.
+ *
+ * Normally the frames are written as raw pixels, one after another.
+ * With framed output (--framed-output), the stream uses the format
+ * of framed input (see framed.hh):
+ *
+ *   FRAME W<width> H<height>\n
+ *   <width*height BGRA pixels>
+ *
+ *   REPEAT <count>\n
+ *
+ * A frame that is the same frame as the previous one (a cache hit
+ * for an unchanged input frame) is not written again; a REPEAT record
+ * is written instead. Consecutive repeats are merged into one record,
+ * which is written when a different frame follows, or at Flush().
+ * A record counts at most MaxRepeat frames, which is all that framed
+ * input accepts; longer runs are written as several records.
+ * Use the bundled unframe.cc to expand the repeats, or to turn them
+ * into frame durations for the encoder.
+ */
+constexpr unsigned long MaxRepeat = 65536;
+
+class FrameOutput
+{
+    int           fd;
+    unsigned      width, height;
+    long        (*write_frame)(int, const void*, std::size_t);
+    bool          framed;
+    FramePtr      last;        // Previous frame written, if framed
+    unsigned long pending = 0; // Repeats of last not yet written
+
+public:
+    unsigned long frames = 0, repeated = 0;
+
+    FrameOutput(int f, unsigned w, unsigned h, long (*write)(int, const void*, std::size_t), bool fr = false)
+        : fd(f), width(w), height(h), write_frame(write), framed(fr) { }
+    ~FrameOutput()
+    {
+        Flush();
+    }
+
+    /* Returns false if the output was closed. */
+    bool Write(const FramePtr& frame)
+    {
+        const std::size_t bytes = std::size_t(width)*height*4;
+        ++frames;
+        if(!framed)
+            return write_frame(fd, frame.get(), bytes) >= (long)bytes;
+        if(frame == last)
+        {
+            ++pending;
+            ++repeated;
+            return true;
+        }
+        if(!Flush()) return false;
+        char line[64];
+        int length = std::snprintf(line, sizeof(line), "FRAME W%u H%u\n", width, height);
+        if(FullyWrite(fd, line, length) < length
+        || write_frame(fd, frame.get(), bytes) < (long)bytes)
+            return false;
+        last = frame;
+        return true;
+    }
+
+    /* Writes the rows [y0,y1) of a frame that is being produced (see slices.hh).
+     * The slices of a frame must be written in order, and cover the whole frame.
+     */
+    bool WriteRows(const FramePtr& frame, unsigned y0, unsigned y1)
+    {
+        const std::size_t row_bytes = std::size_t(width)*4;
+        if(y0 == 0)
+        {
+            ++frames;
+            if(framed)
+            {
+                char line[64];
+                int length = std::snprintf(line, sizeof(line), "FRAME W%u H%u\n", width, height);
+                if(!Flush() || FullyWrite(fd, line, length) < length) return false;
+            }
+        }
+        if(write_frame(fd, frame.get() + std::size_t(y0)*width, (y1-y0)*row_bytes) < (long)((y1-y0)*row_bytes))
+            return false;
+        if(y1 == height && framed) last = frame;
+        return true;
+    }
+
+    /* Writes the pending repeats. */
+    bool Flush()
+    {
+        for(; pending; )
+        {
+            unsigned long count = std::min(pending, MaxRepeat);
+            char line[64];
+            int length = std::snprintf(line, sizeof(line), "REPEAT %lu\n", count);
+            pending -= count;
+            if(FullyWrite(fd, line, length) < length) { pending = 0; return false; }
+        }
+        return true;
+    }
+};
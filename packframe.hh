@@ -0,0 +1,193 @@
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+/* Lossless compression of the frames held by the frame cache.
+ *
+ * A frame is divided into blocks of whole rows, which are compressed
+ * and decompressed independently of each other, in parallel.
+ * Within a block, the codec is an LZ77 variant operating on whole pixels
+ * rather than on bytes. The block is a sequence of literal pixels,
+ * each run of literals followed by a copy of earlier pixels of the block:
+ *
+ *     <literal count> <literal pixels> <copy length> <copy distance>
+ *
+ * where the counts and the distance (in pixels) are LEB128 varints.
+ * The last copy of a block may have length 0 and no distance.
+ * A copy is thus a plain memory move of pixels, at most as long as
+ * its distance at a time. If the top byte is the same in every pixel
+ * of the frame (as the unused alpha byte of filtered frames is),
+ * it is stored once, and the literals are stored as three bytes each.
+ *
+ * Copies are searched from the previous pixel (runs of one color),
+ * the pixel directly above (repeated rows, such as the rows of one scanline
+ * and the rows of the mask) and the most recent occurrence of the
+ * same two pixels (repeated glyphs).
+ */
+struct PackedFrame
+{
+    unsigned      width = 0, height = 0, block_rows = 0;
+    unsigned      literal_bytes = 4;
+    std::uint32_t top = 0; // Top byte of every pixel, if literal_bytes = 3
+    std::vector<std::uint8_t> data;
+    std::vector<std::size_t>  offsets; // Of each block in data, and of the end
+
+    static PackedFrame Pack(const std::uint32_t* pixels, unsigned width, unsigned height)
+    {
+        PackedFrame result;
+        result.width      = width;
+        result.height     = height;
+        result.block_rows = std::max(1u, BlockPixels / width);
+
+        const std::size_t num = std::size_t(width) * height;
+        std::uint32_t differ = 0;
+        #pragma omp parallel for simd schedule(static) reduction(|:differ)
+        for(std::size_t n=0; n<num; ++n)
+            differ |= (pixels[n] ^ pixels[0]) & 0xFF000000u;
+        if(!differ)
+        {
+            result.literal_bytes = 3;
+            result.top           = num ? pixels[0] & 0xFF000000u : 0;
+        }
+
+        const unsigned nblocks = result.Blocks();
+        std::vector<std::vector<std::uint8_t>> blocks(nblocks);
+        #pragma omp parallel for schedule(dynamic)
+        for(unsigned b=0; b<nblocks; ++b)
+        {
+            auto [first, last] = result.BlockRows(b);
+            result.PackBlock(pixels + std::size_t(first)*width, std::size_t(last-first)*width, blocks[b]);
+        }
+
+        result.offsets.resize(nblocks + 1);
+        for(unsigned b=0; b<nblocks; ++b)
+            result.offsets[b+1] = result.offsets[b] + blocks[b].size();
+        result.data.resize(result.offsets[nblocks]);
+        #pragma omp parallel for schedule(static)
+        for(unsigned b=0; b<nblocks; ++b)
+            std::memcpy(&result.data[result.offsets[b]], blocks[b].data(), blocks[b].size());
+        return result;
+    }
+
+    void Unpack(std::uint32_t* pixels) const
+    {
+        const unsigned nblocks = Blocks();
+        #pragma omp parallel for schedule(dynamic)
+        for(unsigned b=0; b<nblocks; ++b)
+        {
+            auto [first, last] = BlockRows(b);
+            UnpackBlock(&data[offsets[b]], pixels + std::size_t(first)*width, std::size_t(last-first)*width);
+        }
+    }
+
+    std::size_t Bytes()    const { return data.size() + offsets.size() * sizeof(std::size_t); }
+    std::size_t RawBytes() const { return std::size_t(width) * height * sizeof(std::uint32_t); }
+
+private:
+    static constexpr unsigned BlockPixels = 65536;
+    static constexpr unsigned HashBits    = 14;
+    static constexpr unsigned MinCopy     = 2;
+
+    unsigned Blocks() const { return (height + block_rows-1) / block_rows; }
+    std::pair<unsigned,unsigned> BlockRows(unsigned b) const
+    {
+        return { b*block_rows, std::min(height, (b+1)*block_rows) };
+    }
+
+    static void PutVarint(std::vector<std::uint8_t>& out, std::size_t value)
+    {
+        for(; value >= 0x80; value >>= 7)
+            out.push_back(std::uint8_t(value | 0x80));
+        out.push_back(std::uint8_t(value));
+    }
+    static std::size_t GetVarint(const std::uint8_t*& in)
+    {
+        std::size_t result = 0;
+        for(unsigned shift=0; ; shift += 7)
+        {
+            std::uint8_t c = *in++;
+            result |= std::size_t(c & 0x7F) << shift;
+            if(!(c & 0x80)) return result;
+        }
+    }
+
+    void PackBlock(const std::uint32_t* in, std::size_t num, std::vector<std::uint8_t>& out) const
+    {
+        std::vector<std::uint32_t> recent(1u << HashBits, ~0u); // Last position of each hash of two pixels
+        auto hash = [&](std::size_t pos)
+        {
+            std::uint64_t pair = in[pos] | std::uint64_t(in[pos+1]) << 32;
+            return unsigned((pair * 0x9E3779B97F4A7C15ull) >> (64 - HashBits));
+        };
+        auto length = [&](std::size_t pos, std::size_t dist)
+        {
+            std::size_t n = 0;
+            while(pos+n < num && in[pos+n] == in[pos+n-dist]) ++n;
+            return n;
+        };
+        auto emit = [&](std::size_t lit_begin, std::size_t lit_end, std::size_t copy, std::size_t dist)
+        {
+            PutVarint(out, lit_end - lit_begin);
+            std::size_t at = out.size();
+            out.resize(at + (lit_end - lit_begin) * literal_bytes);
+            if(literal_bytes == 4)
+                std::memcpy(&out[at], in + lit_begin, (lit_end - lit_begin) * sizeof(std::uint32_t));
+            else
+                for(std::size_t n=lit_begin; n<lit_end; ++n, at += 3)
+                    std::memcpy(&out[at], &in[n], 3); // Little-endian: the low three bytes
+            PutVarint(out, copy);
+            if(copy) PutVarint(out, dist);
+        };
+
+        std::size_t literals = 0, pos = 0;
+        while(pos+1 < num)
+        {
+            std::size_t best = 0, best_dist = 0;
+            auto consider = [&](std::size_t dist)
+            {
+                if(dist == 0 || dist > pos) return;
+                std::size_t n = length(pos, dist);
+                if(n > best) { best = n; best_dist = dist; }
+            };
+            unsigned h = hash(pos);
+            consider(1);
+            consider(width);
+            if(recent[h] != ~0u) consider(pos - recent[h]);
+            recent[h] = pos;
+
+            if(best < MinCopy) { ++pos; continue; }
+            emit(literals, pos, best, best_dist);
+            pos += best;
+            literals = pos;
+        }
+        emit(literals, num, 0, 0);
+    }
+
+    void UnpackBlock(const std::uint8_t* in, std::uint32_t* out, std::size_t num) const
+    {
+        for(std::uint32_t* end = out + num; out < end; )
+        {
+            std::size_t n = GetVarint(in);
+            if(literal_bytes == 4)
+                std::memcpy(out, in, n * sizeof(std::uint32_t));
+            else
+                for(std::size_t k=0; k<n; ++k)
+                    out[k] = top | in[k*3] | in[k*3+1] << 8 | in[k*3+2] << 16;
+            in += n * literal_bytes;
+            out += n;
+            if(!(n = GetVarint(in))) continue;
+            std::size_t dist = GetVarint(in);
+            if(dist == 1)
+                std::fill_n(out, n, out[-1]);
+            else
+                // An overlapping copy repeats the last dist pixels
+                for(std::size_t done = 0; done < n; )
+                {
+                    std::size_t chunk = std::min(n - done, dist);
+                    std::memcpy(out + done, out + done - dist, chunk * sizeof(std::uint32_t));
+                    done += chunk;
+                }
+            out += n;
+        }
+    }
+};
@@ -0,0 +1,225 @@
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+
+/* Real-time mode.
+ *
+ * The offline mode processes every frame fully, no matter how long it takes.
+ * In real-time mode, every input frame must produce an output frame within
+ * the given frame time. Frames are rendered by a separate thread.
+ * If the render of a frame is not complete by its deadline,
+ * the most recent completed frame is re-emitted instead,
+ * so that the output pipe never stalls.
+ *
+ * The cost of each render is measured. When the renderer falls behind,
+ * quality is stepped down (bloom resolution, kernel radius, intermediate size),
+ * and when there is enough headroom, it is stepped back up.
+ */
+
+static const FilterOptions QualityLadder[] =
+{
+    // LanczosRadius, BloomScale, VertStep
+    { 2, 1, 1 }, // Full quality
+    { 2, 2, 1 },
+    { 2, 4, 1 },
+    { 1, 4, 1 },
+    { 1, 4, 2 },
+};
+constexpr unsigned NumQualityLevels = sizeof(QualityLadder) / sizeof(*QualityLadder);
+
+class RealtimeRenderer
+{
+    unsigned in_width, in_height, out_width, out_height, NumScanlines;
+    double   frame_time; // seconds
+
+    std::mutex              lock;
+    std::condition_variable cond;
+    std::thread             worker;
+    bool                    quit = false;
+
+    // Frame waiting to be rendered. A newer frame replaces an older one.
+    FramePtr      pending_input;
+    Fingerprint   pending_print;
+    unsigned long pending_seq = 0;
+
+    // Most recently completed frame.
+    FramePtr      done_input, done_output;
+    Fingerprint   done_print;
+    unsigned      done_level = 0; // Of QualityLadder, used for done_output
+    unsigned long done_seq = 0, collected_seq = 0;
+
+    // Adaptive quality state. Only modified by the worker thread.
+    std::atomic<unsigned> level{0};
+    unsigned              calm = 0;
+
+public:
+    RealtimeRenderer(unsigned iw,unsigned ih, unsigned ow,unsigned oh, unsigned scanlines, double fps)
+        : in_width(iw), in_height(ih), out_width(ow), out_height(oh), NumScanlines(scanlines),
+          frame_time(1.0 / fps),
+          worker([this]{ Run(); }) { }
+
+    ~RealtimeRenderer()
+    {
+        { std::lock_guard<std::mutex> lk(lock); quit = true; }
+        cond.notify_all();
+        worker.join();
+    }
+
+    // Queues a frame for rendering. Returns its sequence number.
+    unsigned long Submit(FramePtr input, Fingerprint print)
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        pending_input = std::move(input);
+        pending_print = std::move(print);
+        cond.notify_all();
+        return ++pending_seq;
+    }
+
+    /* Waits until frame #seq is completed, or until the deadline.
+     * Without a deadline, waits until frame #seq is completed.
+     * If any frame has been completed since the last call,
+     * it is stored into output, and saved into the cache
+     * if it was rendered at full quality. A frame of a lower quality
+     * must not be served for every later repeat of its content.
+     * Returns true if frame #seq was completed.
+     */
+    bool Collect(unsigned long seq, const std::chrono::steady_clock::time_point* deadline,
+                 FrameCache& cache, FramePtr& output)
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        if(deadline)
+            cond.wait_until(lk, *deadline, [&]{ return done_seq >= seq; });
+        else
+            cond.wait(lk, [&]{ return done_seq >= seq; });
+        Store(cache, output);
+        return done_seq >= seq;
+    }
+
+    /* Same as Collect(), but does not wait for anything.
+     * Returns true if a frame was completed since the last call.
+     */
+    bool Poll(FrameCache& cache, FramePtr& output)
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        return Store(cache, output);
+    }
+
+    unsigned Level() const { return level; }
+
+private:
+    bool Store(FrameCache& cache, FramePtr& output)
+    {
+        if(done_seq <= collected_seq) return false;
+        if(done_level == 0) cache.Insert(done_print, done_input, done_output);
+        output        = done_output;
+        collected_seq = done_seq;
+        return true;
+    }
+
+    void Run()
+    {
+        for(;;)
+        {
+            FramePtr      input;
+            Fingerprint   print;
+            unsigned long seq;
+            { std::unique_lock<std::mutex> lk(lock);
+              cond.wait(lk, [&]{ return quit || pending_seq > done_seq; });
+              if(quit) return;
+              input = std::move(pending_input);
+              print = std::move(pending_print);
+              seq   = pending_seq; }
+
+            auto output = NewFrame(out_width * out_height);
+            auto begin  = std::chrono::steady_clock::now();
+            const unsigned quality = level;
+            ConvertPicture(in_width, in_height, out_width, out_height, NumScanlines,
+                           input.get(), output.get(), QualityLadder[quality]);
+            double cost = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            Adapt(cost);
+
+            { std::lock_guard<std::mutex> lk(lock);
+              done_input  = std::move(input);
+              done_output = std::move(output);
+              done_print  = std::move(print);
+              done_level  = quality;
+              done_seq    = seq; }
+            cond.notify_all();
+        }
+    }
+
+    void Adapt(double cost)
+    {
+        // Step down immediately when the frame time is nearly used up.
+        // Step up only after a while of comfortable headroom.
+        if(cost > frame_time * 0.85)
+        {
+            if(level+1 < NumQualityLevels) ++level;
+            calm = 0;
+        }
+        else if(cost < frame_time * 0.45)
+        {
+            if(++calm >= 30 && level > 0) { --level; calm = 0; }
+        }
+        else
+            calm = 0;
+    }
+};
+
+static int RunRealtime(unsigned in_width, unsigned in_height,
+                       unsigned out_width, unsigned out_height,
+                       unsigned NumScanlines, double fps, FrameInput& input, FrameCache& cache,
+                       FrameOutput& out)
+{
+    using Clock = std::chrono::steady_clock;
+    const auto frame_time = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / fps));
+
+    FramePtr         output;
+    RealtimeRenderer renderer(in_width, in_height, out_width, out_height, NumScanlines, fps);
+
+    const unsigned long period = std::max(1l, std::lround(fps)); // Frames between reports
+    bool          have_output = false;
+    unsigned long frames = 0, hits = 0, misses = 0, period_misses = 0;
+    while(FramePtr inframe = input.Next())
+    {
+        auto deadline = Clock::now() + frame_time;
+        ++frames;
+
+        // A frame that missed its deadline is cached (at full quality), and becomes the frame
+        // to re-emit, as soon as it is done rather than at the next miss.
+        renderer.Poll(cache, output);
+
+        Fingerprint print = Fingerprint::Of(inframe.get(), in_width, in_height);
+        if(auto found = cache.Find(print, inframe.get()))
+        {
+            output = std::move(found);
+            ++hits;
+        }
+        else
+        {
+            unsigned long seq = renderer.Submit(std::move(inframe), std::move(print));
+            // The very first frame has nothing to re-emit, so it is waited for.
+            if(!renderer.Collect(seq, have_output ? &deadline : nullptr, cache, output))
+            {
+                ++misses;
+                ++period_misses;
+            }
+        }
+        have_output = true;
+
+        // Repeats are not held back, because the consumer is live.
+        if(!out.Write(output) || !out.Flush()) break;
+
+        if(frames % period == 0 && period_misses)
+        {
+            std::fprintf(stderr, "crt-filter: %lu deadline misses in last %lu frames (quality level %u)\n",
+                period_misses, period, renderer.Level());
+            period_misses = 0;
+        }
+    }
+    std::fprintf(stderr, "crt-filter: %lu frames, %lu cache hits, %lu deadline misses, final quality level %u/%u\n",
+        frames, hits, misses, renderer.Level(), NumQualityLevels-1);
+    return 0;
+}
@@ -0,0 +1,185 @@
+/* Reuse of previously filtered rows.
+ *
+ * Terminals and text editors mostly scroll by whole text rows, or change
+ * only a few rows at a time (typing, a blinking cursor). Such frames miss
+ * the frame cache, yet most of their output already exists in the
+ * previous output frame, possibly at a different vertical position.
+ *
+ * Each input row is hashed, and the vertical shift (including zero) that
+ * matches the most rows of the previous input frame is chosen.
+ * Nonzero shifts are only considered if "moved" is set (--scroll).
+ * An output row is copied from the previous output frame if every input
+ * row it depends on (through the Lanczos filters, the scanline mapping
+ * and the bloom, see ComputeBandSupport()) is unchanged.
+ * The remaining rows are filtered with ConvertPictureRect(), or with the tile cache.
+ *
+ * A nonzero shift is only usable if it moves the output by a whole
+ * number of rows and preserves the phase of the scanlines and of the
+ * shadow mask. Rows whose support touches the top or bottom edge
+ * of the picture are never moved, because the edges affect them.
+ * A moved row was filtered at its old position, where the filter weights
+ * were calculated in float from different coordinates, so the result
+ * differs from a full render by rounding (see the scroll path of --compare).
+ * Rows copied to the same position are identical, so without "moved",
+ * the output does not depend on the previous frames.
+ */
+/* If moving the input down by s rows moves the output down by a whole number
+ * of rows, without changing the phase of the scanlines or of the shadow mask,
+ * returns that number of output rows. Otherwise returns 0.
+ */
+static unsigned OutputRowShift(unsigned in_height, unsigned out_height, unsigned NumScanlines,
+                               unsigned s, const FilterOptions& options)
+{
+    // Input rows -> scanlines -> intermediate rows -> output rows, all exactly.
+    if((s * NumScanlines) % in_height) return 0;
+    unsigned k = s * NumScanlines / in_height;
+    if((k * TotalVertRes) % NumScanlines) return 0;
+    unsigned d = k * TotalVertRes / NumScanlines;
+    if(d % (CellHeight0 + CellHeight1) || d % options.VertStep) return 0;
+    if((std::size_t(d) * out_height) % TotalVertRes) return 0;
+    // The scanline mapping is calculated in float; make sure it shifts exactly.
+    for(unsigned y=0; y+d<TotalVertRes; y+=options.VertStep)
+        if(ScanlineOf(y+d, NumScanlines) != ScanlineOf(y, NumScanlines) + k)
+            return 0;
+    return std::size_t(d) * out_height / TotalVertRes;
+}
+
+/* Filters output rows [y0,y1) of the input frame into the output frame. */
+using RowRenderer = std::function<void(const std::uint32_t* input, std::uint32_t* output, unsigned y0, unsigned y1)>;
+
+class ScrollReuse
+{
+    unsigned in_width, in_height, out_width, out_height, NumScanlines;
+    FilterOptions options;
+    unsigned merge_gap;                   // Dirty rows closer than this are filtered together
+    std::vector<int> in_shifts, out_shifts; // Usable shifts, in input and output rows. Zero first.
+    std::vector<BandSupport> supports;    // For every output row
+
+    FramePtr prev_input, prev_output, cur_input;
+    std::vector<newhash_t> prev_rows, cur_rows; // Row hashes of prev_input and of cur_input
+
+public:
+    unsigned long frames = 0, partial = 0, scrolled = 0, rows_reused = 0, rows_total = 0;
+
+    RowRenderer render; // Used for the rows that must be filtered
+
+    ScrollReuse(unsigned iw,unsigned ih, unsigned ow,unsigned oh, unsigned scanlines, const FilterOptions& opt, bool moved)
+        : in_width(iw), in_height(ih), out_width(ow), out_height(oh), NumScanlines(scanlines), options(opt)
+    {
+        merge_gap = 2 * blur_support<3>(out_width / 640.f, options.BloomScale);
+        for(unsigned y=0; y<out_height; ++y)
+            supports.push_back(ComputeBandSupport(in_width, in_height, out_width, out_height, NumScanlines,
+                                                     0, out_width, y, y+1, options));
+
+        in_shifts.push_back(0);
+        out_shifts.push_back(0);
+        for(unsigned s=1; moved && s<in_height; ++s)
+            if(unsigned o = OutputRowShift(in_height, out_height, NumScanlines, s, options))
+            {
+                in_shifts.push_back(s);   out_shifts.push_back(o);
+                in_shifts.push_back(-s);  out_shifts.push_back(-(int)o);
+            }
+
+        render = [this](const std::uint32_t* input, std::uint32_t* output, unsigned y0, unsigned y1)
+        {
+            ConvertPictureRect(in_width, in_height, out_width, out_height, NumScanlines,
+                               input, output, 0, out_width, y0, y1, options);
+        };
+    }
+
+    /* Remembers the frame that was written last. */
+    void Remember(FramePtr input, FramePtr output)
+    {
+        if(input == cur_input) prev_rows.swap(cur_rows); // Hashed by Render()
+        else if(input != prev_input) prev_rows.clear();
+        cur_input.reset();
+        prev_input  = std::move(input);
+        prev_output = std::move(output);
+    }
+
+    /* Filters the input frame, reusing rows of the previous output where possible. */
+    FramePtr Render(const FramePtr& input)
+    {
+        auto output = NewFrame(std::size_t(out_width) * out_height);
+        ++frames;
+        rows_total += out_height;
+
+        std::vector<int> source(out_height, -1); // Row of prev_output to copy, or -1
+        unsigned reused = prev_output ? FindReusable(input, source) : 0;
+        if(reused < out_height / 8)
+        {
+            // Not worth the trouble.
+            render(input.get(), output.get(), 0, out_height);
+            return output;
+        }
+        rows_reused += reused;
+        ++partial;
+
+        const std::size_t row_bytes = std::size_t(out_width) * sizeof(std::uint32_t);
+        for(unsigned y=0; y<out_height; ++y)
+            if(source[y] >= 0)
+                std::memcpy(output.get() + std::size_t(y)*out_width, prev_output.get() + std::size_t(source[y])*out_width, row_bytes);
+
+        for(unsigned y=0; y<out_height; )
+        {
+            if(source[y] >= 0) { ++y; continue; }
+            unsigned end = y+1;
+            for(unsigned gap=0; end+gap < out_height && gap < merge_gap; )
+                if(source[end+gap] < 0) { end += gap+1; gap = 0; }
+                else ++gap;
+            render(input.get(), output.get(), y, end);
+            y = end;
+        }
+        return output;
+    }
+
+private:
+    void HashRows(const std::uint32_t* pixels, std::vector<newhash_t>& rows) const
+    {
+        rows.resize(in_height);
+        for(unsigned y=0; y<in_height; ++y)
+            rows[y] = newhash_calc((const unsigned char*)(pixels + std::size_t(y)*in_width), in_width*4);
+    }
+
+    /* Chooses the best shift, and stores into source[] the previous output row
+     * that each output row can be copied from. Returns the number of such rows.
+     */
+    unsigned FindReusable(const FramePtr& frame, std::vector<int>& source)
+    {
+        const std::uint32_t* input = frame.get();
+        if(prev_rows.empty()) HashRows(prev_input.get(), prev_rows);
+        HashRows(input, cur_rows);
+        cur_input = frame;
+
+        unsigned best = 0, best_count = 0;
+        for(unsigned n=0; n<in_shifts.size(); ++n)
+        {
+            int s = in_shifts[n];
+            unsigned count = 0;
+            for(int y = std::max(0, -s); y < (int)in_height && y+s < (int)in_height; ++y)
+                count += cur_rows[y] == prev_rows[y+s];
+            if(count > best_count) { best = n; best_count = count; }
+        }
+        const int s = in_shifts[best], o = out_shifts[best];
+
+        // Number of verified identical input rows before each row
+        std::vector<unsigned> clean(in_height+1, 0);
+        for(int y=0; y<(int)in_height; ++y)
+            clean[y+1] = clean[y] + (y+s >= 0 && y+s < (int)in_height
+                                     && cur_rows[y] == prev_rows[y+s]
+                                     && std::memcmp(input + std::size_t(y)*in_width,
+                                                    prev_input.get() + std::size_t(y+s)*in_width, in_width*4) == 0);
+
+        unsigned result = 0;
+        for(int y=0; y<(int)out_height; ++y)
+        {
+            const BandSupport& sup = supports[y];
+            if(clean[sup.in_end] - clean[sup.in_begin] != sup.in_end - sup.in_begin) continue;
+            if(s != 0 && (y+o < 0 || y+o >= (int)out_height || sup.vedge || supports[y+o].vedge)) continue;
+            source[y] = y+o;
+            ++result;
+        }
+        if(s != 0 && result >= out_height / 8) ++scrolled;
+        return result;
+    }
+};
@@ -0,0 +1,278 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <string>
+#include <csignal>
+#include <map>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+
+/* Server mode.
+ *
+ *   crt-filter --serve <socket> [options]
+ *   crt-filter --connect <socket> [--priority <n>] <in-width> <in-height> <out-width> <out-height> <numscanlines>
+ *
+ * Running several filters side by side (such as make-reencoded.sh does)
+ * oversubscribes the machine, because each of them has threads for all cores.
+ * Instead, one server process accepts any number of streams over a UNIX socket,
+ * or over TCP if the socket is given as <host>:<port>.
+ * Each client sends one line of text:
+ *
+ *   <in-width> <in-height> <out-width> <out-height> <numscanlines> [<priority>]
+ *
+ * followed by the input frames, and receives the output frames
+ * on the same connection, as with stdin/stdout in the offline mode.
+ * --connect is such a client that relays stdin and stdout.
+ *
+ * Every stream is filtered by its own thread, but all of them share
+ * the worker threads of TaskPool::Shared(). Only a limited number of
+ * frames are filtered at once. When more streams are waiting,
+ * the stream that has used the least time, relative to its priority,
+ * goes first (fair share). Streams of the same geometry share
+ * the frame cache, so a picture filtered for one stream is
+ * reused by the others.
+ * On NUMA machines, the streams are assigned to the nodes in turn
+ * (see TaskPool::SetHomeNode()).
+ */
+/* Opens a socket, and either listens or connects at the address.
+ * The address is either the path of a UNIX socket, or <host>:<port> for TCP.
+ * When listening, the host may be empty.
+ * Returns -1 on failure.
+ */
+static int OpenSocket(const char* address, bool listening)
+{
+    const char* colon = std::strrchr(address, ':');
+    if(!colon)
+    {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        std::snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", address);
+        if(listening) unlink(address);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd >= 0 && (listening ? bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0
+                                 : connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0))
+            { close(fd); fd = -1; }
+        return fd;
+    }
+    std::string host(address, colon);
+    struct addrinfo hints = {}, *result = nullptr;
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = listening ? AI_PASSIVE : 0;
+    if(getaddrinfo(host.empty() ? nullptr : host.c_str(), colon+1, &hints, &result) != 0)
+        return -1;
+    int fd = -1;
+    for(auto* a = result; a && fd < 0; a = a->ai_next)
+    {
+        if((fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0) continue;
+        int one = 1;
+        if(listening) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(listening ? bind(fd, a->ai_addr, a->ai_addrlen) < 0 || listen(fd, 16) < 0
+                     : connect(fd, a->ai_addr, a->ai_addrlen) < 0)
+            { close(fd); fd = -1; }
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+class FairShare
+{
+    struct Client
+    {
+        double   used = 0;  // Seconds of filtering, divided by the priority
+        unsigned priority;
+        bool     waiting = false;
+    };
+    std::mutex              lock;
+    std::condition_variable cond;
+    std::map<unsigned, Client> clients;
+    unsigned                next_id = 0, running = 0, limit;
+
+public:
+    explicit FairShare(unsigned max_running) : limit(std::max(1u, max_running)) { }
+
+    unsigned Join(unsigned priority)
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        // A new stream starts level with the least served one,
+        // so that it does not take over until it has caught up.
+        auto least = std::min_element(clients.begin(), clients.end(),
+                                      [](auto& a, auto& b) { return a.second.used < b.second.used; });
+        double used = least == clients.end() ? 0 : least->second.used;
+        Client& c = clients[next_id];
+        c.used     = used;
+        c.priority = std::max(1u, priority);
+        return next_id++;
+    }
+    void Leave(unsigned id)
+    {
+        { std::lock_guard<std::mutex> lk(lock);
+          clients.erase(id); }
+        cond.notify_all();
+    }
+
+    /* Runs func() when it is the turn of the client. */
+    void Run(unsigned id, const std::function<void()>& func)
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        clients[id].waiting = true;
+        cond.wait(lk, [&]{ return running < limit && IsNext(id); });
+        clients[id].waiting = false;
+        ++running;
+        lk.unlock();
+
+        auto begin = std::chrono::steady_clock::now();
+        func();
+        double cost = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        lk.lock();
+        --running;
+        clients[id].used += cost / clients[id].priority;
+        lk.unlock();
+        cond.notify_all();
+    }
+
+private:
+    bool IsNext(unsigned id) const
+    {
+        const Client& self = clients.at(id);
+        for(auto& c: clients)
+            if(c.second.waiting && c.first != id
+            && (c.second.used < self.used || (c.second.used == self.used && c.first < id)))
+                return false;
+        return true;
+    }
+};
+
+class Server
+{
+    StreamOptions options;
+    unsigned      tolerance;
+    FairShare     share;
+
+    // Frame caches shared by the streams of each geometry
+    struct Shared
+    {
+        FrameCache cache;
+        std::mutex lock;
+        Shared(unsigned w, unsigned h, unsigned tol, unsigned ow, unsigned oh, std::size_t limit)
+            : cache(w, h, tol, ow, oh, limit) { }
+    };
+    std::mutex lock;
+    std::map<std::array<unsigned,5>, std::weak_ptr<Shared>> geometries;
+    unsigned   next_stream = 0;
+
+public:
+    Server(const StreamOptions& opt, unsigned tol)
+        : options(opt), tolerance(tol),
+          share(CurrentTuning.frames ? CurrentTuning.frames : TaskPool::Shared().Size() / 2) { }
+
+    int Run(const char* path)
+    {
+        int fd = OpenSocket(path, true);
+        if(fd < 0)
+        {
+            std::perror(path);
+            return 1;
+        }
+        std::signal(SIGPIPE, SIG_IGN);
+        std::fprintf(stderr, "crt-filter: Serving at %s\n", path);
+        for(;;)
+        {
+            int client = accept(fd, nullptr, nullptr);
+            if(client < 0)
+            {
+                if(errno == EINTR) continue;
+                std::perror("accept");
+                return 1;
+            }
+            std::thread([this,client]{ Serve(client); }).detach();
+        }
+    }
+
+private:
+    void Serve(int fd)
+    {
+    #ifdef _OPENMP
+        omp_set_num_threads(1); // The parallelism comes from the pool.
+    #endif
+        unsigned id;
+        { std::lock_guard<std::mutex> lk(lock); id = next_stream++; }
+        char name[32];
+        std::snprintf(name, sizeof(name), "crt-filter[%u]", id);
+        TaskPool::Shared().SetHomeNode(id % NumNodes());
+
+        // Header line
+        char line[256]; unsigned length = 0;
+        while(length+1 < sizeof(line) && read(fd, &line[length], 1) == 1 && line[length] != '\n') ++length;
+        line[length] = '\0';
+        unsigned long sizes[5] = {};
+        unsigned      priority = 1;
+        const char* error = std::sscanf(line, "%lu %lu %lu %lu %lu %u", &sizes[0], &sizes[1], &sizes[2], &sizes[3], &sizes[4], &priority) < 5
+                          ? "Invalid stream header" : CheckGeometry(sizes[0], sizes[1], sizes[2], sizes[3], sizes[4]);
+        if(error)
+        {
+            std::fprintf(stderr, "%s: %s: %s\n", name, error, line);
+            close(fd);
+            return;
+        }
+        const unsigned in_width = sizes[0], in_height = sizes[1], out_width = sizes[2], out_height = sizes[3], NumScanlines = sizes[4];
+        std::fprintf(stderr, "%s: %ux%u -> %ux%u, %u scanlines, priority %u\n",
+            name, in_width, in_height, out_width, out_height, NumScanlines, priority);
+
+        std::shared_ptr<Shared> shared;
+        { std::lock_guard<std::mutex> lk(lock);
+          auto& weak = geometries[{in_width, in_height, out_width, out_height, NumScanlines}];
+          if(!(shared = weak.lock()))
+              weak = shared = std::make_shared<Shared>(in_width, in_height, tolerance, out_width, out_height,
+                                                       std::size_t(options.cache_mb) << 20); }
+
+        unsigned client = share.Join(priority);
+        FrameInput  input(fd, in_width*in_height);
+        FrameOutput output(fd, out_width, out_height, FullyWrite);
+        FilterStream(in_width, in_height, out_width, out_height, NumScanlines, options,
+                     input, shared->cache, &shared->lock, output, name,
+                     [&](const std::function<void()>& render) { share.Run(client, render); });
+        share.Leave(client);
+        close(fd);
+    }
+};
+
+/* Relays stdin to the server, and the output from the server to stdout. */
+static int RunClient(const char* path, unsigned in_width, unsigned in_height,
+                     unsigned out_width, unsigned out_height, unsigned NumScanlines, unsigned priority,
+                     long (*write_frame)(int, const void*, std::size_t))
+{
+    int fd = OpenSocket(path, false);
+    if(fd < 0)
+    {
+        std::perror(path);
+        return 1;
+    }
+    char line[128];
+    int length = std::snprintf(line, sizeof(line), "%u %u %u %u %u %u\n",
+                               in_width, in_height, out_width, out_height, NumScanlines, priority);
+    FullyWrite(fd, line, length);
+
+    std::thread sender([&]
+    {
+        std::vector<char> buffer(std::size_t(in_width)*in_height*4);
+        for(long n; (n = read(0, &buffer[0], buffer.size())) > 0 || (n < 0 && errno == EINTR); )
+            if(n > 0 && FullyWrite(fd, &buffer[0], n) < n)
+                break;
+        shutdown(fd, SHUT_WR);
+    });
+    const std::size_t out_bytes = std::size_t(out_width)*out_height*4;
+    auto frame = NewFrame(out_width * out_height);
+    while(FullyRead(fd, frame.get(), out_bytes) == (long)out_bytes)
+    {
+        if(write_frame(1, frame.get(), out_bytes) < (long)out_bytes) break;
+        // A spliced frame must not be overwritten.
+        if(write_frame != FullyWrite) frame = NewFrame(out_width * out_height);
+    }
+    shutdown(fd, SHUT_RDWR);
+    sender.join();
+    close(fd);
+    return 0;
+}
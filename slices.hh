@@ -0,0 +1,69 @@
+#include <chrono>
+
+/* Low-latency mode.
+ *
+ *   crt-filter --slices <n> [options] <in-width> <in-height> <out-width> <out-height> <numscanlines>
+ *
+ * Normally the first byte of an output frame is written only after
+ * the whole frame has been filtered. In low-latency mode, each stage of
+ * ConvertPicture() is divided into n bands of rows, and the tasks run
+ * top to bottom. Each horizontal slice of output is written as soon as
+ * the vertical pass and the bloom of the rows it depends on are done,
+ * while the rest of the frame is still being filtered.
+ * The output is identical to that of the normal mode.
+ *
+ * The latency of each slice is measured from the moment its input frame
+ * was completely read, to the moment the slice was written.
+ */
+static int RunSlices(unsigned in_width, unsigned in_height,
+                     unsigned out_width, unsigned out_height,
+                     unsigned NumScanlines, unsigned num_slices, const StreamOptions& options,
+                     FrameInput& input, FrameCache& cache, FrameOutput& out)
+{
+    using Clock = std::chrono::steady_clock;
+    FilterOptions filter = options.filter;
+    filter.Bands = num_slices = std::clamp(num_slices, 1u, out_height);
+
+    struct SliceStats { unsigned begin, end; double sum = 0, max = 0; };
+    std::vector<SliceStats> slices(num_slices);
+    unsigned long frames = 0, filtered = 0;
+    for(FramePtr inframe; (inframe = input.Next()); ++frames)
+    {
+        const auto arrived = Clock::now();
+        Fingerprint print = Fingerprint::Of(inframe.get(), in_width, in_height);
+        if(FramePtr found = cache.Find(print, inframe.get()))
+        {
+            if(!out.Write(found)) break;
+            continue;
+        }
+
+        auto output = NewFrame(std::size_t(out_width)*out_height);
+        bool ok = true;
+        unsigned slice = 0;
+        ConvertPicture(in_width, in_height, out_width, out_height, NumScanlines,
+                       inframe.get(), output.get(), filter, [&](unsigned y0, unsigned y1)
+        {
+            ok = ok && out.WriteRows(output, y0, y1);
+
+            double ms = std::chrono::duration<double, std::milli>(Clock::now() - arrived).count();
+            SliceStats& s = slices[slice++];
+            s.begin = y0;
+            s.end   = y1;
+            s.sum  += ms;
+            s.max   = std::max(s.max, ms);
+            if(options.stats)
+                std::fprintf(stderr, "crt-filter: frame %lu: rows %u-%u written after %.1f ms\n", frames, y0, y1, ms);
+        });
+        if(!ok) break;
+        cache.Insert(print, std::move(inframe), std::move(output));
+        ++filtered;
+    }
+    out.Flush();
+
+    std::fprintf(stderr, "crt-filter: %lu frames, %lu filtered in %u slices\n", frames, filtered, num_slices);
+    if(filtered)
+        for(unsigned k=0; k<num_slices; ++k)
+            std::fprintf(stderr, "crt-filter: slice %u (rows %u-%u): latency %.1f ms average, %.1f ms max\n",
+                k, slices[k].begin, slices[k].end, slices[k].sum / filtered, slices[k].max);
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include <functional>
+
+/* Filters output pixels [x0,x1) x [y0,y1) of the input frame into the output frame. */
+using RectRenderer = std::function<void(const std::uint32_t* input, std::uint32_t* output,
+                                        unsigned x0, unsigned x1, unsigned y0, unsigned y1)>;
+
+/* Skipping of constant regions.
+ *
+ * DOS screens are mostly black background. The output is divided into
+ * blocks. A block whose whole input support (see ComputeBandSupport())
+ * is of a single color depends on nothing but that color.
+ * For black, the output is black, and nothing is filtered.
+ * For other colors, the output of the block is saved the first time
+ * it is filtered, and reused whenever that block is of the same color again.
+ * Only the remaining blocks are filtered with ConvertPictureRect().
+ * Saved blocks are only reused at the same position, and the rest
+ * is rendered with ConvertPictureRect(), so the result is identical
+ * to a full render (see the sparse path of --compare).
+ */
+class ConstantRegions
+{
+    static constexpr unsigned BlockWidth  = 64; // In output pixels
+    static constexpr unsigned BlockHeight = 32;
+    static constexpr unsigned NumColors   = 4;  // Non-black colors remembered
+    static constexpr unsigned MinSkipped  = 4;  // At least 1/4 of a row of blocks must be skippable
+
+    unsigned in_width, in_height, out_width, out_height, NumScanlines;
+    FilterOptions options;
+    unsigned blocks_x, blocks_y;
+    std::vector<BandSupport> supports; // For every block
+
+    struct SavedColor
+    {
+        std::uint32_t              color = 0;
+        std::vector<std::uint32_t> pixels; // A full output frame
+        std::vector<bool>          have;   // For every block
+        unsigned long              used = 0; // Last call of RenderRect() that used it
+    };
+    SavedColor    saved[NumColors];
+    unsigned long calls = 0;
+
+    static constexpr std::uint32_t NotConstant = ~0u;
+
+public:
+    // Output pixels produced, and produced without filtering
+    unsigned long pixels = 0, black = 0, constant = 0;
+
+    ConstantRegions(unsigned iw,unsigned ih, unsigned ow,unsigned oh, unsigned scanlines, const FilterOptions& opt)
+        : in_width(iw), in_height(ih), out_width(ow), out_height(oh), NumScanlines(scanlines), options(opt),
+          blocks_x((ow + BlockWidth-1) / BlockWidth), blocks_y((oh + BlockHeight-1) / BlockHeight)
+    {
+        for(unsigned by=0; by<blocks_y; ++by)
+            for(unsigned bx=0; bx<blocks_x; ++bx)
+                supports.push_back(ComputeBandSupport(in_width, in_height, out_width, out_height, NumScanlines,
+                    bx*BlockWidth, std::min((bx+1)*BlockWidth, out_width),
+                    by*BlockHeight, std::min((by+1)*BlockHeight, out_height), options));
+    }
+
+    void RenderRect(const std::uint32_t* input, std::uint32_t* output,
+                    unsigned x0, unsigned x1, unsigned y0, unsigned y1)
+    {
+        const unsigned bx0 = x0 / BlockWidth,  bx1 = (x1 + BlockWidth-1)  / BlockWidth;
+        const unsigned by0 = y0 / BlockHeight, by1 = (y1 + BlockHeight-1) / BlockHeight;
+        const unsigned nbx = bx1 - bx0, nblocks = nbx * (by1-by0);
+        pixels += std::size_t(x1-x0) * (y1-y0);
+        ++calls;
+
+        std::vector<std::uint32_t> colors(nblocks);
+        #pragma omp parallel for schedule(dynamic)
+        for(unsigned n=0; n<nblocks; ++n)
+            colors[n] = BlockColor(input, supports[(by0 + n/nbx)*blocks_x + bx0 + n%nbx]);
+
+        // Splitting a band costs more than it saves, unless enough of it can be skipped.
+        std::vector<bool> split(by1-by0);
+        for(unsigned by=by0; by<by1; ++by)
+        {
+            auto row = colors.begin() + (by-by0)*nbx;
+            unsigned skippable = 0;
+            for(unsigned bx=bx0; bx<bx1; ++bx)
+            {
+                const SavedColor* s = row[bx-bx0] != NotConstant ? Find(row[bx-bx0]) : nullptr;
+                skippable += row[bx-bx0] == 0 || (s && s->have[by*blocks_x + bx]);
+            }
+            split[by-by0] = skippable * MinSkipped >= nbx;
+        }
+
+        // Produce the blocks that can be skipped, and mark the rest.
+        std::vector<bool> filter(nblocks, true);
+        for(unsigned n=0; n<nblocks; ++n)
+        {
+            const unsigned bx = bx0 + n%nbx, by = by0 + n/nbx;
+            // The part of this block within the rectangle
+            const unsigned cx0 = std::max(x0, bx*BlockWidth),  cx1 = std::min(x1, (bx+1)*BlockWidth);
+            const unsigned cy0 = std::max(y0, by*BlockHeight), cy1 = std::min(y1, (by+1)*BlockHeight);
+            if(colors[n] == NotConstant || (colors[n] == 0 && !split[by-by0]))
+                continue;
+            if(colors[n] == 0)
+            {
+                for(unsigned y=cy0; y<cy1; ++y)
+                    std::fill_n(output + std::size_t(y)*out_width + cx0, cx1-cx0, 0u);
+                black += std::size_t(cx1-cx0) * (cy1-cy0);
+                filter[n] = false;
+                continue;
+            }
+            SavedColor* s = Find(colors[n]);
+            if(!s || !s->have[by*blocks_x + bx] || !split[by-by0])
+                continue;
+            s->used = calls;
+            for(unsigned y=cy0; y<cy1; ++y)
+                std::memcpy(output + std::size_t(y)*out_width + cx0, &s->pixels[std::size_t(y)*out_width + cx0],
+                            (cx1-cx0) * sizeof(std::uint32_t));
+            constant += std::size_t(cx1-cx0) * (cy1-cy0);
+            filter[n] = false;
+        }
+
+        // Filter runs of marked blocks. Successive block rows
+        // with identical runs are filtered together.
+        for(unsigned by=by0; by<by1; )
+        {
+            auto row = filter.begin() + (by-by0)*nbx;
+            unsigned end = by+1;
+            while(end < by1 && std::equal(row, row+nbx, filter.begin() + (end-by0)*nbx))
+                ++end;
+            for(unsigned bx=0; bx<nbx; )
+            {
+                if(!row[bx]) { ++bx; continue; }
+                unsigned run = bx+1;
+                while(run < nbx && row[run]) ++run;
+                ConvertPictureRect(in_width, in_height, out_width, out_height, NumScanlines, input, output,
+                                   std::max(x0, (bx0+bx)*BlockWidth),  std::min(x1, (bx0+run)*BlockWidth),
+                                   std::max(y0, by*BlockHeight),       std::min(y1, end*BlockHeight), options);
+                bx = run;
+            }
+            by = end;
+        }
+
+        // Save the constant blocks that were filtered in whole.
+        for(unsigned n=0; n<nblocks; ++n)
+        {
+            const unsigned bx = bx0 + n%nbx, by = by0 + n/nbx;
+            const unsigned bx_end = std::min((bx+1)*BlockWidth, out_width), by_end = std::min((by+1)*BlockHeight, out_height);
+            if(!filter[n] || colors[n] == NotConstant || colors[n] == 0
+            || bx*BlockWidth < x0 || bx_end > x1 || by*BlockHeight < y0 || by_end > y1)
+                continue;
+            SavedColor* s = Saved(colors[n]);
+            if(!s) continue;
+            for(unsigned y=by*BlockHeight; y<by_end; ++y)
+                std::memcpy(&s->pixels[std::size_t(y)*out_width + bx*BlockWidth], output + std::size_t(y)*out_width + bx*BlockWidth,
+                            (bx_end - bx*BlockWidth) * sizeof(std::uint32_t));
+            s->have[by*blocks_x + bx] = true;
+        }
+    }
+
+private:
+    /* Returns the color of the input support of the block, or NotConstant. */
+    std::uint32_t BlockColor(const std::uint32_t* input, const BandSupport& sup) const
+    {
+        const std::uint32_t color = input[std::size_t(sup.in_begin)*in_width + sup.in_left] & 0xFFFFFF;
+        for(unsigned y=sup.in_begin; y<sup.in_end; ++y)
+        {
+            const std::uint32_t* row = input + std::size_t(y)*in_width;
+            std::uint32_t diff = 0;
+            #pragma omp simd reduction(|:diff)
+            for(unsigned x=sup.in_left; x<sup.in_right; ++x)
+                diff |= (row[x] ^ color) & 0xFFFFFF;
+            if(diff) return NotConstant;
+        }
+        return color;
+    }
+
+    /* The saved output for the color, or nullptr. */
+    SavedColor* Find(std::uint32_t color)
+    {
+        for(auto& s: saved)
+            if(!s.pixels.empty() && s.color == color)
+                return &s;
+        return nullptr;
+    }
+
+    /* The saved output for the color, replacing the least recently used color.
+     * A color used in this call is not replaced, so that more than NumColors
+     * colors in one frame do not keep replacing each other; then returns nullptr.
+     */
+    SavedColor* Saved(std::uint32_t color)
+    {
+        SavedColor* s = Find(color);
+        if(!s)
+        {
+            s = std::min_element(saved, saved+NumColors,
+                                 [](const SavedColor& a, const SavedColor& b) { return a.used < b.used; });
+            if(s->used == calls) return nullptr;
+            s->color = color;
+            s->pixels.resize(std::size_t(out_width) * out_height);
+            s->have.assign(blocks_x * blocks_y, false);
+        }
+        s->used = calls;
+        return s;
+    }
+};
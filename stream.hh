@@ -0,0 +1,155 @@
+#include <functional>
+#include <mutex>
+#include <string>
+#include <map>
+
+/* Filtering of one stream of frames, as in the offline mode.
+ * Used by main() for stdin/stdout, and by the server for each client.
+ */
+struct StreamOptions
+{
+    bool          scroll = true, sparse = true, stats = false;
+    bool          moved_rows = false; // Reuse scrolled rows too (inexact, see scroll.hh)
+    unsigned      tile_width = 0, tile_height = 0;
+    unsigned      cache_mb = 0;   // Size of the compressed frames in FrameCache, 0 = none
+    FilterOptions filter; // Of every ConvertPictureRect()
+};
+
+/* Runs render(), possibly after waiting for its turn (see server.hh). */
+using Scheduler = std::function<void(const std::function<void()>& render)>;
+
+/* The filtering state for one geometry: the frame cache,
+ * and the reuse of scrolled rows, tiles and constant regions.
+ * If cache_lock is given, the cache is shared with other streams,
+ * and is only accessed while holding cache_lock.
+ * Messages are prefixed with name.
+ */
+class StreamFilter
+{
+    unsigned             in_width, in_height, out_width, out_height;
+    const StreamOptions& options;
+    FrameCache&          cache;
+    std::mutex*          cache_lock;
+    std::string          name;
+    ScrollReuse          reuse;
+    TileCache            tiles;
+    ConstantRegions      constant;
+    Fingerprint          previous; // Of the previous input frame
+
+public:
+    StreamFilter(unsigned iw, unsigned ih, unsigned ow, unsigned oh, unsigned NumScanlines,
+                 const StreamOptions& opt, FrameCache& c, std::mutex* lock, const char* n)
+        : in_width(iw), in_height(ih), out_width(ow), out_height(oh),
+          options(opt), cache(c), cache_lock(lock), name(n),
+          reuse(iw, ih, ow, oh, NumScanlines, opt.filter, opt.moved_rows),
+          tiles(iw, ih, ow, oh, NumScanlines, opt.filter, opt.tile_width, opt.tile_height),
+          constant(iw, ih, ow, oh, NumScanlines, opt.filter)
+    {
+        if(options.sparse)
+        {
+            tiles.filter = [this](const std::uint32_t* in, std::uint32_t* out, unsigned x0, unsigned x1, unsigned y0, unsigned y1)
+            {
+                constant.RenderRect(in, out, x0, x1, y0, y1);
+            };
+            reuse.render = [this](const std::uint32_t* in, std::uint32_t* out, unsigned y0, unsigned y1)
+            {
+                constant.RenderRect(in, out, 0, out_width, y0, y1);
+            };
+        }
+        if(options.tile_width && options.tile_height)
+        {
+            if(tiles.Enabled())
+                reuse.render = [this](const std::uint32_t* in, std::uint32_t* out, unsigned y0, unsigned y1)
+                {
+                    tiles.RenderRows(in, out, y0, y1);
+                };
+            else
+                std::fprintf(stderr, "%s: No usable tile size for this geometry, tile cache disabled\n", name.c_str());
+        }
+    }
+
+    /* Returns the output of the input frame (frame number "frame"),
+     * from the cache if possible. schedule, if given, runs the filtering.
+     */
+    FramePtr Filter(FramePtr inframe, unsigned long frame, const Scheduler& schedule = nullptr)
+    {
+        auto with_cache = [&](auto&& func)
+        {
+            if(!cache_lock) return func();
+            std::lock_guard<std::mutex> lk(*cache_lock);
+            return func();
+        };
+
+        FramePtr output;
+        Fingerprint print = Fingerprint::Of(inframe.get(), in_width, in_height);
+        if(options.stats)
+            std::fprintf(stderr, "%s: frame %lu: %u of %zu tiles changed\n",
+                name.c_str(), frame, print.Changed(previous), print.tiles.size());
+        if(!(output = with_cache([&]{ return cache.Find(print, inframe.get()); })))
+        {
+            const unsigned long skipped = constant.black + constant.constant;
+            auto render = [&]{ output = reuse.Render(inframe); };
+            if(schedule) schedule(render); else render();
+            with_cache([&]{ cache.Insert(print, inframe, output); });
+            if(options.stats)
+                std::fprintf(stderr, "%s: frame %lu: %.1f%% constant regions skipped\n",
+                    name.c_str(), frame, (constant.black + constant.constant - skipped) * 100.0 / (out_width*out_height));
+        }
+        else if(options.stats)
+            std::fprintf(stderr, "%s: frame %lu: cached\n", name.c_str(), frame);
+        if(options.stats) previous = std::move(print);
+        if(options.scroll) reuse.Remember(std::move(inframe), output);
+        return output;
+    }
+
+    /* Prints the statistics. */
+    void Report() const
+    {
+        const char* n = name.c_str();
+        if(cache.tolerance)
+            std::fprintf(stderr, "%s: %lu frames approximated within tolerance %u\n", n, cache.approximated, cache.tolerance);
+        if(cache.packed_bytes)
+            std::fprintf(stderr, "%s: %zu frames kept compressed in %.1f MB, compression ratio %.1f:1, %lu restored\n",
+                n, cache.archive.size(), cache.archive_bytes / 1e6, double(cache.packed_raw) / cache.packed_bytes, cache.restored);
+        if(reuse.rows_reused)
+            std::fprintf(stderr, "%s: %lu of %lu filtered frames reused rows (%lu scrolled), %lu of %lu rows reused (%.1f%%)\n",
+                n, reuse.partial, reuse.frames, reuse.scrolled,
+                reuse.rows_reused, reuse.rows_total, reuse.rows_reused * 100.0 / reuse.rows_total);
+        if(constant.pixels)
+            std::fprintf(stderr, "%s: %.1f%% of filtered pixels were in constant regions (%.1f%% black)\n",
+                n, (constant.black + constant.constant) * 100.0 / constant.pixels, constant.black * 100.0 / constant.pixels);
+        if(tiles.lookups)
+            std::fprintf(stderr, "%s: tiles of %ux%u -> %ux%u: %lu of %lu reused (%.1f%%), %lu near edges always filtered\n",
+                n, tiles.TileWidth(), tiles.TileHeight(), tiles.OutTileWidth(), tiles.OutTileHeight(),
+                tiles.hits, tiles.lookups, tiles.hits * 100.0 / tiles.lookups, tiles.uncached);
+    }
+};
+
+static void ReportStageTraffic(const StreamOptions& options, const char* name)
+{
+    if(options.stats && StageTraffic.same_node + StageTraffic.other_node)
+        std::fprintf(stderr, "%s: %.1f%% of %.1f MB passed between stages was produced by a task on another NUMA node (%u nodes)\n",
+            name, StageTraffic.other_node * 100.0 / (StageTraffic.same_node + StageTraffic.other_node),
+            (StageTraffic.same_node + StageTraffic.other_node) / 1e6, NumNodes());
+}
+
+/* Filters the frames of input into output until either ends.
+ * See StreamFilter for the parameters.
+ */
+static int FilterStream(unsigned in_width, unsigned in_height,
+                        unsigned out_width, unsigned out_height,
+                        unsigned NumScanlines, const StreamOptions& options,
+                        FrameInput& input, FrameCache& cache, std::mutex* cache_lock, FrameOutput& output,
+                        const char* name = "crt-filter", const Scheduler& schedule = nullptr)
+{
+    StreamFilter filter(in_width, in_height, out_width, out_height, NumScanlines, options, cache, cache_lock, name);
+    for(unsigned long frame = 0; FramePtr inframe = input.Next(); ++frame)
+        if(!output.Write(filter.Filter(std::move(inframe), frame, schedule)))
+            break;
+    output.Flush();
+    filter.Report();
+    if(output.repeated)
+        std::fprintf(stderr, "%s: %lu of %lu frames written as repeats\n", name, output.repeated, output.frames);
+    ReportStageTraffic(options, name);
+    return 0;
+}
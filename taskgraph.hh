@@ -0,0 +1,359 @@
+#ifndef bqtCrtTaskGraphHH
+#define bqtCrtTaskGraphHH
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <sched.h>
+#include <pthread.h>
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+/* NUMA node of each CPU, as listed in sysfs. Empty if not known. */
+static const std::vector<int>& CpuNodes()
+{
+    static const std::vector<int> nodes = []
+    {
+        std::vector<int> result;
+        for(unsigned node=0; ; ++node)
+        {
+            char path[64];
+            std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+            std::FILE* fp = std::fopen(path, "r");
+            if(!fp) break;
+            // Format: 0-7,16-23
+            for(unsigned first, last; std::fscanf(fp, "%u", &first) == 1; )
+            {
+                int c = std::fgetc(fp);
+                last = first;
+                if(c == '-' && std::fscanf(fp, "%u", &last) == 1) c = std::fgetc(fp);
+                if(result.size() <= last) result.resize(last+1, 0);
+                for(unsigned cpu=first; cpu<=last; ++cpu) result[cpu] = node;
+                if(c != ',') break;
+            }
+            std::fclose(fp);
+        }
+        return result;
+    }();
+    return nodes;
+}
+static int NodeOfCpu(int cpu)
+{
+    auto& nodes = CpuNodes();
+    return cpu >= 0 && cpu < (int)nodes.size() ? nodes[cpu] : 0;
+}
+static unsigned NumNodes()
+{
+    auto& nodes = CpuNodes();
+    return nodes.empty() ? 1 : *std::max_element(nodes.begin(), nodes.end()) + 1;
+}
+/* NUMA node of the CPU that the calling thread is running on. */
+static int CurrentNode()
+{
+    return NodeOfCpu(sched_getcpu());
+}
+
+/* Task graph scheduler.
+ *
+ * A frame is filtered as a graph of tasks over bands of rows
+ * (input -> horizontal pass -> vertical pass -> bloom and pack),
+ * where each task waits only for the bands it actually reads.
+ * The tasks run on a persistent pool of worker threads.
+ * Each worker runs the tasks it made ready itself (newest first,
+ * for cache locality), and steals from the other workers when idle.
+ * There are no barriers between the stages, so the stages of different
+ * bands, and of different graphs (frames, streams) overlap freely.
+ *
+ * Within a task, OpenMP loops run on one thread.
+ *
+ * On NUMA machines, the workers can be pinned to CPUs (Pin()),
+ * ordered by node. A graph then runs on the workers of the home node
+ * of the thread that runs it (SetHomeNode()), and idle workers steal
+ * from their own node first.
+ */
+class TaskPool;
+
+class TaskGraph
+{
+public:
+    using TaskId = unsigned;
+
+    /* Adds a task. Tasks must be added after the tasks they depend on. */
+    TaskId Add(std::function<void()> func)
+    {
+        tasks.emplace_back();
+        tasks.back().func = std::move(func);
+        return tasks.size()-1;
+    }
+    /* Makes task run only after task "on" has completed. */
+    void Depend(TaskId task, TaskId on)
+    {
+        tasks[on].successors.push_back(task);
+        ++tasks[task].pending;
+    }
+
+    /* Runs all tasks, and waits for them to complete.
+     * While waiting, the calling thread runs woken() after every Wake(),
+     * so that tasks can hand work (such as blocking I/O) back to it.
+     */
+    inline void Run(const std::function<void()>& woken = nullptr);
+
+    /* Called by a task: makes Run() call woken() on the calling thread. */
+    void Wake()
+    {
+        { std::lock_guard<std::mutex> lk(lock); woke = true; }
+        done.notify_all();
+    }
+
+private:
+    struct Task
+    {
+        std::function<void()> func;
+        std::vector<TaskId>    successors;
+        std::atomic<unsigned>  pending{0};
+    };
+    std::deque<Task>        tasks;
+    int                     node = -1; // Preferred NUMA node
+    std::atomic<unsigned>   remaining{0};
+    bool                    woke = false;
+    std::mutex              lock;
+    std::condition_variable done;
+
+    friend class TaskPool;
+};
+
+class TaskPool
+{
+    struct Job { TaskGraph* graph; TaskGraph::TaskId task; };
+    struct Worker
+    {
+        std::mutex      lock;
+        std::deque<Job> queue;
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread>             threads;
+    std::vector<int>                     nodes; // NUMA node of each worker, -1 if not pinned
+    bool                                 pinned = false;
+
+    std::mutex              sleep_lock;
+    std::condition_variable wake;
+    std::atomic<unsigned>   queued{0};
+    bool                    quit = false;
+    std::atomic<unsigned>   next_queue{0};
+
+    static inline thread_local int current = -1; // Index of the worker running on this thread
+    static inline thread_local int home    = -1; // Preferred NUMA node of graphs run by this thread
+
+public:
+    explicit TaskPool(unsigned num)
+    {
+        Start(num);
+    }
+    ~TaskPool()
+    {
+        Stop();
+    }
+
+    /* Changes the number of workers. Must not be called while graphs are running. */
+    void Resize(unsigned num)
+    {
+        if(num == Size()) return;
+        Stop();
+        Start(num);
+        if(pinned) Pin();
+    }
+
+    /* The pool shared by all graphs. One worker per OpenMP thread. */
+    static TaskPool& Shared()
+    {
+    #ifdef _OPENMP
+        static TaskPool pool(omp_get_max_threads());
+    #else
+        static TaskPool pool(std::thread::hardware_concurrency());
+    #endif
+        return pool;
+    }
+
+    unsigned Size() const { return workers.size(); }
+
+    /* Pins each worker to one of the CPUs that the process may run on,
+     * the CPUs of each node in turn. Must be called before any graph is run.
+     */
+    void Pin()
+    {
+        cpu_set_t allowed;
+        if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+        std::vector<int> cpus;
+        for(int cpu=0; cpu<CPU_SETSIZE; ++cpu)
+            if(CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+        std::stable_sort(cpus.begin(), cpus.end(), [](int a, int b) { return NodeOfCpu(a) < NodeOfCpu(b); });
+        for(unsigned n=0; n<threads.size() && !cpus.empty(); ++n)
+        {
+            // Spread evenly, so that every node gets its share of workers.
+            int cpu = cpus[std::size_t(n) * cpus.size() / threads.size()];
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if(pthread_setaffinity_np(threads[n].native_handle(), sizeof(set), &set) == 0)
+                nodes[n] = NodeOfCpu(cpu);
+        }
+        pinned = true;
+    }
+    bool Pinned() const { return pinned; }
+
+    /* Makes the graphs run by the calling thread prefer the workers of the node.
+     * If the workers are pinned, the calling thread is moved to that node too.
+     */
+    void SetHomeNode(int node)
+    {
+        home = node;
+        if(!pinned) return;
+        cpu_set_t allowed, set;
+        CPU_ZERO(&set);
+        if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+        for(int cpu=0; cpu<CPU_SETSIZE; ++cpu)
+            if(CPU_ISSET(cpu, &allowed) && NodeOfCpu(cpu) == node)
+                CPU_SET(cpu, &set);
+        if(CPU_COUNT(&set)) sched_setaffinity(0, sizeof(set), &set);
+    }
+    static int HomeNode() { return home; }
+
+    void Push(TaskGraph* graph, TaskGraph::TaskId task)
+    {
+        // Own queue if called by a worker, otherwise spread around
+        // the workers of the preferred node, if there are any.
+        unsigned n = current >= 0 ? current : next_queue++ % workers.size();
+        if(current < 0 && graph->node >= 0 && std::count(nodes.begin(), nodes.end(), graph->node))
+            while(nodes[n] != graph->node)
+                n = next_queue++ % workers.size();
+        { std::lock_guard<std::mutex> lk(workers[n]->lock);
+          workers[n]->queue.push_back(Job{graph, task}); }
+        ++queued;
+        { std::lock_guard<std::mutex> lk(sleep_lock); }
+        wake.notify_one();
+    }
+
+private:
+    void Start(unsigned num)
+    {
+        quit = false;
+        workers.clear();
+        for(unsigned n=0; n<std::max(num, 1u); ++n) workers.push_back(std::make_unique<Worker>());
+        nodes.assign(workers.size(), -1);
+        for(unsigned n=0; n<workers.size(); ++n) threads.emplace_back([this,n]{ Run(n); });
+    }
+    void Stop()
+    {
+        { std::lock_guard<std::mutex> lk(sleep_lock); quit = true; }
+        wake.notify_all();
+        for(auto& t: threads) t.join();
+        threads.clear();
+    }
+
+    bool Pop(unsigned self, Job& job)
+    {
+        // Newest from own queue, oldest from others. Workers of the same node first.
+        for(unsigned same_node=2; same_node-- > 0; )
+            for(unsigned k=0; k<workers.size(); ++k)
+            {
+                unsigned n = (self + k) % workers.size();
+                if((nodes[n] == nodes[self]) != bool(same_node)) continue;
+                Worker& w = *workers[n];
+                std::lock_guard<std::mutex> lk(w.lock);
+                if(w.queue.empty()) continue;
+                if(k == 0) { job = w.queue.back();  w.queue.pop_back(); }
+                else       { job = w.queue.front(); w.queue.pop_front(); }
+                --queued;
+                return true;
+            }
+        return false;
+    }
+
+    void Run(unsigned self)
+    {
+        current = self;
+    #ifdef _OPENMP
+        omp_set_num_threads(1);
+    #endif
+        for(;;)
+        {
+            Job job;
+            if(!Pop(self, job))
+            {
+                std::unique_lock<std::mutex> lk(sleep_lock);
+                wake.wait(lk, [&]{ return quit || queued > 0; });
+                if(quit) return;
+                continue;
+            }
+            auto& task = job.graph->tasks[job.task];
+            task.func();
+            for(auto s: task.successors)
+                if(--job.graph->tasks[s].pending == 0)
+                    Push(job.graph, s);
+            // Under the lock, so that the graph is not destroyed before this is done with it.
+            std::lock_guard<std::mutex> lk(job.graph->lock);
+            if(--job.graph->remaining == 0)
+                job.graph->done.notify_all();
+        }
+    }
+};
+
+void TaskGraph::Run(const std::function<void()>& woken)
+{
+    TaskPool& pool = TaskPool::Shared();
+    if(pool.Size() <= 1 || tasks.size() <= 4)
+    {
+        // Not worth the handoff. The OpenMP loops within the tasks may use all threads.
+        // Newest ready task first, as the workers do, so that the first
+        // bands of the last stage complete early instead of at the end.
+        std::vector<TaskId> ready;
+        for(TaskId n=tasks.size(); n-- > 0; )
+            if(tasks[n].pending == 0)
+                ready.push_back(n);
+        while(!ready.empty())
+        {
+            Task& t = tasks[ready.back()];
+            ready.pop_back();
+            t.func();
+            for(auto s = t.successors.rbegin(); s != t.successors.rend(); ++s)
+                if(--tasks[*s].pending == 0)
+                    ready.push_back(*s);
+            if(woke && woken) { woke = false; woken(); }
+        }
+        return;
+    }
+    remaining = tasks.size();
+    node      = TaskPool::HomeNode();
+    // Find the initially ready tasks before pushing any, because
+    // the tasks that complete meanwhile make their successors ready.
+    std::vector<TaskId> ready;
+    for(TaskId n=0; n<tasks.size(); ++n)
+        if(tasks[n].pending == 0)
+            ready.push_back(n);
+    for(TaskId n: ready)
+        pool.Push(this, n);
+    std::unique_lock<std::mutex> lk(lock);
+    for(;;)
+    {
+        done.wait(lk, [&]{ return remaining == 0 || (woke && woken); });
+        if(woke && woken)
+        {
+            woke = false;
+            lk.unlock();
+            woken();
+            lk.lock();
+        }
+        if(remaining == 0) break;
+    }
+}
+
+#endif
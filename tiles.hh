@@ -0,0 +1,224 @@
+#include <unordered_map>
+#include <numeric>
+
+/* If moving the input right by s columns moves the output right by a whole
+ * number of columns, without changing the phase of the shadow mask,
+ * returns that number of output columns. Otherwise returns 0.
+ */
+static unsigned OutputColumnShift(unsigned in_width, unsigned out_width, unsigned s)
+{
+    constexpr unsigned cellwidth  = CellWidth0 + CellBlank0 + CellWidth1 + CellBlank1 + CellWidth2 + CellBlank2;
+    constexpr unsigned cellheight = CellHeight0 + CellHeight1;
+    // Successive cells are staggered vertically, so the mask repeats only after several cells.
+    constexpr unsigned period = cellwidth * (cellheight / std::gcd(CellStagger, cellheight));
+
+    if((s * TotalHorizRes) % in_width) return 0;
+    unsigned d = s * TotalHorizRes / in_width;
+    if(d % period) return 0;
+    if((std::size_t(d) * out_width) % TotalHorizRes) return 0;
+    return std::size_t(d) * out_width / TotalHorizRes;
+}
+
+/* Memoization of filtered tiles.
+ *
+ * Text mode pictures consist of relatively few distinct character cells,
+ * repeated all over the screen (spaces, borders, common letters).
+ * The picture is divided into tiles. An output tile depends only on
+ * a neighbourhood of input pixels around the tile (see ComputeBandSupport()),
+ * so when the same neighbourhood recurs, anywhere in the same frame
+ * or in a later frame, the saved output tile is pasted instead.
+ * The tiles that are not found are filtered, and saved.
+ *
+ * This requires that moving the input by one tile moves the output
+ * by a whole number of pixels, without changing the phase of the
+ * scanlines or of the shadow mask. The tile size is the smallest
+ * such multiple of the requested size (the character cell), so that
+ * every tile covers whole cells, aligned to the cells of the picture:
+ * for 16-row cells and a phase that repeats every 5 rows, 80 rows.
+ * Tiles near the edges of the picture are always filtered,
+ * because the edges affect them.
+ * A tile pasted at another position differs from a full render by rounding,
+ * as with the moved rows of ScrollReuse (see the tiles path of --compare).
+ */
+class TileCache
+{
+    static constexpr unsigned MaxEntries = 16384;
+
+    unsigned in_width, in_height, out_width, out_height, NumScanlines;
+    FilterOptions options;
+    unsigned tile_w = 0, tile_h = 0;         // In input pixels
+    unsigned out_tile_w = 0, out_tile_h = 0; // In output pixels
+    unsigned tiles_x = 0, tiles_y = 0;
+    unsigned margin_x = 0, margin_y = 0;     // Neighbourhood around a tile, in input pixels
+    std::vector<bool> cacheable;             // For every tile
+
+    struct Entry
+    {
+        std::vector<std::uint32_t> input;  // The neighbourhood
+        std::vector<std::uint32_t> output; // The output tile
+    };
+    std::unordered_map<newhash_t, Entry> entries;
+
+public:
+    unsigned long lookups = 0, hits = 0, uncached = 0;
+
+    RectRenderer filter; // Used for the tiles that must be filtered
+
+    TileCache(unsigned iw,unsigned ih, unsigned ow,unsigned oh, unsigned scanlines, const FilterOptions& opt,
+              unsigned want_w, unsigned want_h)
+        : in_width(iw), in_height(ih), out_width(ow), out_height(oh), NumScanlines(scanlines), options(opt)
+    {
+        filter = [this](const std::uint32_t* input, std::uint32_t* output, unsigned x0, unsigned x1, unsigned y0, unsigned y1)
+        {
+            ConvertPictureRect(in_width, in_height, out_width, out_height, NumScanlines, input, output, x0, x1, y0, y1, options);
+        };
+        want_w = std::max(want_w, 1u);
+        want_h = std::max(want_h, 1u);
+        for(unsigned w=want_w; w<=in_width/2 && !out_tile_w; w+=want_w)
+            if((out_tile_w = OutputColumnShift(in_width, out_width, w)))
+                tile_w = w;
+        for(unsigned h=want_h; h<=in_height/2 && !out_tile_h; h+=want_h)
+        {
+            // Every pair of tile rows must be a usable shift apart.
+            unsigned o = OutputRowShift(in_height, out_height, NumScanlines, h, options);
+            for(unsigned k=2; o && k*h < in_height; ++k)
+                if(!OutputRowShift(in_height, out_height, NumScanlines, k*h, options))
+                    o = 0;
+            if((out_tile_h = o))
+                tile_h = h;
+        }
+        if(!Enabled()) return;
+
+        tiles_x = in_width  / tile_w;
+        tiles_y = in_height / tile_h;
+        auto support = [&](unsigned tx, unsigned ty)
+        {
+            return ComputeBandSupport(in_width, in_height, out_width, out_height, NumScanlines,
+                                      tx*out_tile_w, (tx+1)*out_tile_w, ty*out_tile_h, (ty+1)*out_tile_h, options);
+        };
+        // The neighbourhood is the support of a tile in the middle, plus
+        // one pixel in case of rounding differences elsewhere.
+        const unsigned mx = tiles_x/2, my = tiles_y/2;
+        BandSupport mid = support(mx, my);
+        margin_x = std::max(mx*tile_w - mid.in_left, mid.in_right - (mx+1)*tile_w) + 1;
+        margin_y = std::max(my*tile_h - mid.in_begin, mid.in_end - (my+1)*tile_h) + 1;
+
+        for(unsigned ty=0; ty<tiles_y; ++ty)
+            for(unsigned tx=0; tx<tiles_x; ++tx)
+            {
+                BandSupport sup = support(tx, ty);
+                cacheable.push_back(!sup.vedge && !sup.hedge
+                    && tx*tile_w >= margin_x && (tx+1)*tile_w + margin_x <= in_width
+                    && ty*tile_h >= margin_y && (ty+1)*tile_h + margin_y <= in_height
+                    && sup.in_left  >= tx*tile_w - margin_x && sup.in_right <= (tx+1)*tile_w + margin_x
+                    && sup.in_begin >= ty*tile_h - margin_y && sup.in_end   <= (ty+1)*tile_h + margin_y);
+            }
+    }
+
+    bool Enabled() const { return out_tile_w && out_tile_h; }
+
+    /* Tile size that is actually used, in input and output pixels. */
+    unsigned TileWidth()  const { return tile_w; }
+    unsigned TileHeight() const { return tile_h; }
+    unsigned OutTileWidth()  const { return out_tile_w; }
+    unsigned OutTileHeight() const { return out_tile_h; }
+
+    /* Filters output rows [y0,y1) of the input frame into the output frame. */
+    void RenderRows(const std::uint32_t* input, std::uint32_t* output, unsigned y0, unsigned y1)
+    {
+        unsigned ty0 = Enabled() ? (y0 + out_tile_h-1) / out_tile_h : 0;
+        unsigned ty1 = Enabled() ? std::min(y1 / out_tile_h, tiles_y) : 0;
+        if(ty0 >= ty1)
+        {
+            Filter(input, output, 0, out_width, y0, y1);
+            return;
+        }
+        // Rows that do not form whole tiles
+        if(y0 < ty0*out_tile_h) Filter(input, output, 0, out_width, y0, ty0*out_tile_h);
+        if(ty1*out_tile_h < y1) Filter(input, output, 0, out_width, ty1*out_tile_h, y1);
+
+        // A column of output that does not form whole tiles is handled as an extra tile.
+        const unsigned columns = tiles_x + (tiles_x*out_tile_w < out_width);
+        std::vector<bool>      missed(columns * (ty1-ty0), true);
+        std::vector<newhash_t> keys(columns * (ty1-ty0));
+        std::vector<std::uint32_t> neighbourhood;
+        unsigned nmissed = 0;
+        for(unsigned ty=ty0; ty<ty1; ++ty)
+            for(unsigned tx=0; tx<columns; ++tx)
+            {
+                const unsigned n = (ty-ty0)*columns + tx;
+                if(tx >= tiles_x || !cacheable[ty*tiles_x + tx])
+                {
+                    ++uncached; ++nmissed;
+                    continue;
+                }
+                ++lookups;
+                Gather(input, tx, ty, neighbourhood);
+                keys[n] = newhash_calc((const unsigned char*)&neighbourhood[0], neighbourhood.size()*4);
+                auto i = entries.find(keys[n]);
+                if(i != entries.end() && i->second.input == neighbourhood)
+                {
+                    Paste(i->second.output, output, tx, ty);
+                    missed[n] = false;
+                    ++hits;
+                }
+                else
+                    ++nmissed;
+            }
+
+        if(nmissed * 2 > columns * (ty1-ty0))
+        {
+            // Mostly new content. Filtering it in one piece is cheaper.
+            Filter(input, output, 0, out_width, ty0*out_tile_h, ty1*out_tile_h);
+        }
+        else
+            for(unsigned ty=ty0; ty<ty1; ++ty)
+                for(unsigned tx=0; tx<columns; )
+                {
+                    const unsigned row = (ty-ty0)*columns;
+                    if(!missed[row + tx]) { ++tx; continue; }
+                    // Filter a run of missed tiles, bridging single found tiles.
+                    unsigned end = tx+1;
+                    while(end < columns && (missed[row + end] || (end+1 < columns && missed[row + end+1])))
+                        ++end;
+                    Filter(input, output, tx*out_tile_w, std::min(end*out_tile_w, out_width),
+                           ty*out_tile_h, (ty+1)*out_tile_h);
+                    tx = end;
+                }
+
+        if(entries.size() >= MaxEntries) entries.clear();
+        for(unsigned ty=ty0; ty<ty1; ++ty)
+            for(unsigned tx=0; tx<tiles_x; ++tx)
+                if(missed[(ty-ty0)*columns + tx] && cacheable[ty*tiles_x + tx])
+                {
+                    Entry& e = entries[keys[(ty-ty0)*columns + tx]];
+                    Gather(input, tx, ty, e.input);
+                    e.output.resize(std::size_t(out_tile_w) * out_tile_h);
+                    for(unsigned y=0; y<out_tile_h; ++y)
+                        std::memcpy(&e.output[y*out_tile_w], output + std::size_t(ty*out_tile_h + y)*out_width + tx*out_tile_w,
+                                    out_tile_w*sizeof(std::uint32_t));
+                }
+    }
+
+private:
+    void Filter(const std::uint32_t* input, std::uint32_t* output, unsigned x0, unsigned x1, unsigned y0, unsigned y1) const
+    {
+        filter(input, output, x0, x1, y0, y1);
+    }
+
+    void Gather(const std::uint32_t* input, unsigned tx, unsigned ty, std::vector<std::uint32_t>& result) const
+    {
+        const unsigned x0 = tx*tile_w - margin_x, w = tile_w + 2*margin_x;
+        const unsigned y0 = ty*tile_h - margin_y, h = tile_h + 2*margin_y;
+        result.resize(std::size_t(w) * h);
+        for(unsigned y=0; y<h; ++y)
+            std::memcpy(&result[y*w], input + std::size_t(y0+y)*in_width + x0, w*sizeof(std::uint32_t));
+    }
+
+    void Paste(const std::vector<std::uint32_t>& tile, std::uint32_t* output, unsigned tx, unsigned ty) const
+    {
+        for(unsigned y=0; y<out_tile_h; ++y)
+            std::memcpy(output + std::size_t(ty*out_tile_h + y)*out_width + tx*out_tile_w, &tile[y*out_tile_w],
+                        out_tile_w*sizeof(std::uint32_t));
+    }
+};
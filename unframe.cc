@@ -0,0 +1,113 @@
+/* Adapter for the framed output of crt-filter (--framed-output).
+ *
+ *   unframe < framed > raw
+ *       Writes every frame as raw pixels, expanding the REPEAT records.
+ *
+ *   unframe --timecodes <file> <fps> < framed > raw
+ *       Writes each frame only once, and into <file> the time at which
+ *       each frame starts, in the Matroska timecode format v2.
+ *       Give that file to the encoder (x264 --tcfile-in, mkvmerge --timestamps)
+ *       so that repeated frames become longer frames instead of copies.
+ *       If the stream ends in repeats, the last frame is written once more,
+ *       starting at the time of the last repeat, so that the duration of
+ *       the video (frames/fps) is kept.
+ *
+ * Build: g++ -o unframe unframe.cc -O2 -std=c++17
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <cerrno>
+#include <unistd.h>
+
+static bool FullyRead(int fd, void* buf, std::size_t size)
+{
+    for(char* p = (char*)buf; size > 0; )
+    {
+        long r = read(fd, p, size);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return false;
+        p += r; size -= r;
+    }
+    return true;
+}
+
+static bool FullyWrite(int fd, const void* buf, std::size_t size)
+{
+    for(const char* p = (const char*)buf; size > 0; )
+    {
+        long r = write(fd, p, size);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return false;
+        p += r; size -= r;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    std::FILE* timecodes = nullptr;
+    double     fps = 0;
+    if(argc == 4 && std::strcmp(argv[1], "--timecodes") == 0 && (fps = std::atof(argv[3])) > 0)
+    {
+        if(!(timecodes = std::fopen(argv[2], "w"))) { std::perror(argv[2]); return 1; }
+        std::fprintf(timecodes, "# timecode format v2\n");
+    }
+    else if(argc != 1)
+    {
+        std::fprintf(stderr, "Usage: unframe [--timecodes <file> <fps>] < framed > raw\n");
+        return 1;
+    }
+
+    std::vector<char> frame;
+    unsigned long     frames = 0, written = 0; // Frames shown, frames written
+    bool              repeating = false;       // The last record was a nonzero REPEAT
+    for(;;)
+    {
+        char line[256];
+        std::size_t length = 0;
+        while(length+1 < sizeof(line) && read(0, &line[length], 1) == 1 && line[length] != '\n') ++length;
+        if(length == 0) break;
+        line[length] = '\0';
+
+        unsigned width = 0, height = 0;
+        unsigned long repeat = 0;
+        if(std::sscanf(line, "REPEAT %lu", &repeat) == 1)
+        {
+            if(frame.empty()) continue;
+            frames += repeat;
+            repeating = repeating || repeat > 0;
+            if(!timecodes)
+                for(; repeat > 0; --repeat, ++written)
+                    if(!FullyWrite(1, &frame[0], frame.size())) return 1;
+            continue;
+        }
+        if(std::sscanf(line, "FRAME W%u H%u", &width, &height) != 2)
+        {
+            std::fprintf(stderr, "unframe: Invalid record: %s\n", line);
+            return 1;
+        }
+        frame.resize(std::size_t(width) * height * 4);
+        if(!FullyRead(0, &frame[0], frame.size()))
+        {
+            std::fprintf(stderr, "unframe: Truncated frame\n");
+            return 1;
+        }
+        if(timecodes) std::fprintf(timecodes, "%.3f\n", frames * 1000.0 / fps);
+        repeating = false;
+        ++frames;
+        ++written;
+        if(!FullyWrite(1, &frame[0], frame.size())) return 1;
+    }
+    if(timecodes && repeating)
+    {
+        // Without this, the repeats at the end would be lost
+        std::fprintf(timecodes, "%.3f\n", (frames-1) * 1000.0 / fps);
+        ++written;
+        if(!FullyWrite(1, &frame[0], frame.size())) return 1;
+    }
+    if(timecodes) std::fclose(timecodes);
+    std::fprintf(stderr, "unframe: %lu frames, %lu written\n", frames, written);
+    return 0;
+}